@@ -0,0 +1,473 @@
+/*
+ * Ping-pong latency and streaming bandwidth of every pipe of the repo. The
+ * same source is built once per transport (see the Makefile):
+ *
+ *	BENCH_NATIVE	pipe(2) and fork(2) of Linux, the baseline
+ *	BENCH_TCP	the userspace TCP pipe of stage1
+ *	BENCH_COMSO	/dev/comso of stage2, UDP and one way only
+ *	BENCH_UDP	the UDP my_pipe system call of syscall
+ *	BENCH_IVSHMEM	my_pipe over ivshmem and my_fork of fork
+ *
+ *	pipebench [-n iters] [-t MB] [-b pipe size] [size ...]	native, ivshmem
+ *	pipebench [-n iters] [-t MB] client|server peer [size ...]	tcp, udp
+ *	pipebench [-n iters] [-t MB] client|server [size ...]	comso
+ *
+ * Both sides must get the same options. The client measures and prints one
+ * row per message size, with the round trip time of the ping-pong and the
+ * bandwidth of a stream of messages that ends with an ack of the server.
+ * Through /dev/comso nothing comes back, so there the server prints the
+ * bandwidth it saw and the latency stays empty.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#if defined(BENCH_NATIVE)
+#include <sys/wait.h>
+#define	TRANSPORT	"native"
+#elif defined(BENCH_TCP)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#define	TRANSPORT	"tcp"
+#define	PORT		23456		/* port of stage1 */
+#elif defined(BENCH_COMSO)
+#define	TRANSPORT	"comso"
+#define	DGRAM		8192		/* fits in the UDP send buffer */
+#elif defined(BENCH_UDP)
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/ioccom.h>
+#define	TRANSPORT	"udp"
+#define	DGRAM		8192		/* fits in the UDP send buffer */
+#define	SETIPADDR	_IOW('f', 132, int *)
+int my_pipe(int fildes[2]);
+#elif defined(BENCH_IVSHMEM)
+#include <sys/ioctl.h>
+#include "../fork/my_pipe.h"
+#define	TRANSPORT	"ivshmem"
+int my_pipe(int fildes[2]);
+int my_fork(void);
+#else
+#error "define one of BENCH_NATIVE, BENCH_TCP, BENCH_COMSO, BENCH_UDP, BENCH_IVSHMEM"
+#endif
+
+#ifndef DGRAM
+#define	DGRAM		0		/* byte stream, no datagrams */
+#endif
+
+#define	WARMUP		16		/* round trips we do not count */
+#define	MAX_MSGS	(1 << 20)	/* messages per stream at most */
+
+/*
+ * Our side of the connection to the other process or unikernel
+ */
+struct chan {
+	int	rfd;		/* messages of the peer come from here */
+	int	wfd;		/* and ours go there, -1 if we only read */
+	int	server;		/* 1 echoes and sinks, 0 measures */
+	int	oneway;		/* only client to server, no ping-pong */
+	pid_t	child;		/* server process of native */
+};
+
+static size_t def_sizes[] = { 1, 8, 64, 512, 4096, 65536, 1048576 };
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static void usage(void)
+{
+#if defined(BENCH_TCP) || defined(BENCH_UDP)
+	fprintf(stderr, "usage: pipebench [-n iters] [-t MB] client|server "
+			"peer [size ...]\n");
+#elif defined(BENCH_COMSO)
+	fprintf(stderr, "usage: pipebench [-n iters] [-t MB] client|server "
+			"[size ...]\n");
+#else
+	fprintf(stderr, "usage: pipebench [-n iters] [-t MB] [-b pipe size] "
+			"[size ...]\n");
+#endif
+	exit(1);
+}
+
+#if defined(BENCH_NATIVE) || defined(BENCH_IVSHMEM)
+//grow the buffer of the pipe, the default one is tiny for large messages
+static void set_bufsize(int fd, int size)
+{
+#if defined(BENCH_NATIVE)
+#ifdef F_SETPIPE_SZ
+	if (fcntl(fd, F_SETPIPE_SZ, size) < 0)
+		perror("F_SETPIPE_SZ");
+#endif
+#else
+	if (ioctl(fd, MY_PIPE_SETSZ, &size) < 0)
+		perror("MY_PIPE_SETSZ");
+#endif
+}
+
+/*
+ * Two pipes, one for every direction, and a child that is the server
+ */
+static int chan_open(struct chan *c, int argc, char **argv, int bufsize)
+{
+	int up[2], down[2], ret;
+#if defined(BENCH_NATIVE)
+	if (pipe(up) < 0 || pipe(down) < 0)
+		die("pipe");
+#else
+	if (my_pipe(up) < 0 || my_pipe(down) < 0)
+		die("my_pipe");
+#endif
+	if (bufsize > 0) {
+		set_bufsize(up[1], bufsize);
+		set_bufsize(down[1], bufsize);
+	}
+#if defined(BENCH_NATIVE)
+	ret = fork();
+#else
+	ret = my_fork();
+#endif
+	if (ret < 0)
+		die("fork");
+	c->server = ret == 0;
+	c->child = ret;
+	c->oneway = 0;
+	if (c->server) {
+		c->rfd = up[0];
+		c->wfd = down[1];
+		close(up[1]);
+		close(down[0]);
+	} else {
+		c->rfd = down[0];
+		c->wfd = up[1];
+		close(up[0]);
+		close(down[1]);
+	}
+	return 0;
+}
+#else
+//the first argument is the role of the unikernel
+static int chan_role(struct chan *c, const char *role)
+{
+	if (strcmp(role, "server") == 0)
+		c->server = 1;
+	else if (strcmp(role, "client") == 0)
+		c->server = 0;
+	else
+		usage();
+	c->child = 0;
+	return 0;
+}
+#endif
+
+#if defined(BENCH_TCP)
+/*
+ * A connection in every direction, like the my_pipe of stage1. Both sides
+ * listen first and connect after, so it does not matter which one starts
+ * first.
+ */
+static int chan_open(struct chan *c, int argc, char **argv, int bufsize)
+{
+	struct sockaddr_in sa;
+	struct hostent *hp;
+	int lsd, one = 1;
+	if (argc < 2)
+		usage();
+	chan_role(c, argv[0]);
+	c->oneway = 0;
+	if ((hp = gethostbyname(argv[1])) == NULL) {
+		fprintf(stderr, "DNS lookup failed for host %s\n", argv[1]);
+		exit(1);
+	}
+	if ((lsd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+		die("socket");
+	setsockopt(lsd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(PORT);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(lsd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		die("bind");
+	if (listen(lsd, 2) < 0)
+		die("listen");
+	memcpy(&sa.sin_addr.s_addr, hp->h_addr, sizeof(struct in_addr));
+	for (;;) {
+		if ((c->wfd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+			die("socket");
+		if (connect(c->wfd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+			break;
+		if (errno != ECONNREFUSED && errno != ETIMEDOUT)
+			die("connect");
+		//the peer does not listen yet
+		close(c->wfd);
+		sleep(1);
+	}
+	setsockopt(c->wfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((c->rfd = accept(lsd, NULL, NULL)) < 0)
+		die("accept");
+	close(lsd);
+	return 2;
+}
+#elif defined(BENCH_COMSO)
+/*
+ * /dev/comso sends to the SERVER_IP it was built with, so the client can only
+ * write and the server can only read
+ */
+static int chan_open(struct chan *c, int argc, char **argv, int bufsize)
+{
+	if (argc < 1)
+		usage();
+	chan_role(c, argv[0]);
+	c->oneway = 1;
+	c->rfd = c->wfd = -1;
+	if (c->server)
+		c->rfd = open("/dev/comso", O_RDONLY);
+	else
+		c->wfd = open("/dev/comso", O_WRONLY);
+	if (c->rfd < 0 && c->wfd < 0)
+		die("/dev/comso");
+	return 1;
+}
+#elif defined(BENCH_UDP)
+/*
+ * The write end of the UDP my_pipe sends to the peer, the read end gets
+ * whatever arrives at the port
+ */
+static int chan_open(struct chan *c, int argc, char **argv, int bufsize)
+{
+	int fd[2];
+	uint32_t ip;
+	if (argc < 2)
+		usage();
+	chan_role(c, argv[0]);
+	c->oneway = 0;
+	if ((ip = inet_addr(argv[1])) == INADDR_NONE) {
+		fprintf(stderr, "bad address %s\n", argv[1]);
+		exit(1);
+	}
+	if (my_pipe(fd) < 0)
+		die("my_pipe");
+	if (ioctl(fd[1], SETIPADDR, &ip) < 0)
+		die("SETIPADDR");
+	c->rfd = fd[0];
+	c->wfd = fd[1];
+	//nothing is queued for a server that is not up, give it a head start
+	if (!c->server)
+		sleep(1);
+	return 2;
+}
+#endif
+
+static void chan_close(struct chan *c)
+{
+	if (c->rfd >= 0)
+		close(c->rfd);
+	if (c->wfd >= 0)
+		close(c->wfd);
+#if defined(BENCH_NATIVE)
+	if (c->child > 0)
+		waitpid(c->child, NULL, 0);
+#endif
+}
+
+//send a whole message, in datagrams that the UDP transports can carry
+static void send_msg(struct chan *c, const char *buf, size_t size)
+{
+	size_t done, chunk;
+	ssize_t n;
+	for (done = 0; done < size; done += n) {
+		chunk = size - done;
+		if (DGRAM > 0 && chunk > DGRAM)
+			chunk = DGRAM;
+		if ((n = write(c->wfd, buf + done, chunk)) < 0)
+			die("write");
+	}
+}
+
+//receive a whole message, a byte stream may return it in pieces
+static void recv_msg(struct chan *c, char *buf, size_t size)
+{
+	size_t got;
+	ssize_t n;
+	for (got = 0; got < size; got += n) {
+		if ((n = read(c->rfd, buf + got, size - got)) < 0)
+			die("read");
+		if (n == 0) {
+			fprintf(stderr, "peer went away\n");
+			exit(1);
+		}
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_header(void)
+{
+	printf("%-8s %8s %8s %10s %10s %10s\n", "pipe", "size", "msgs",
+			"rtt p50", "rtt p99", "MB/s");
+	printf("%-8s %8s %8s %10s %10s %10s\n", "", "(bytes)", "", "(us)",
+			"(us)", "");
+}
+
+/*
+ * Latency is NULL when there was no ping-pong
+ */
+static void print_row(size_t size, size_t msgs, uint64_t *lat, int iters,
+		double mbs)
+{
+	char p50[16] = "-", p99[16] = "-";
+	if (lat != NULL) {
+		qsort(lat, iters, sizeof(*lat), cmp_u64);
+		snprintf(p50, sizeof(p50), "%.2f", lat[iters / 2] / 1000.0);
+		snprintf(p99, sizeof(p99), "%.2f",
+				lat[(size_t)iters * 99 / 100] / 1000.0);
+	}
+	printf("%-8s %8zu %8zu %10s %10s %10.1f\n", TRANSPORT, size, msgs, p50,
+			p99, mbs);
+	fflush(stdout);
+}
+
+/*
+ * The client sends a message and waits for it to come back, the server
+ * echoes it
+ */
+static void pingpong(struct chan *c, char *buf, size_t size, int iters,
+		uint64_t *lat)
+{
+	uint64_t t;
+	int i;
+	for (i = 0; i < WARMUP + iters; i++) {
+		if (c->server) {
+			recv_msg(c, buf, size);
+			send_msg(c, buf, size);
+			continue;
+		}
+		t = now();
+		send_msg(c, buf, size);
+		recv_msg(c, buf, size);
+		if (i >= WARMUP)
+			lat[i - WARMUP] = now() - t;
+	}
+}
+
+/*
+ * The client writes msgs messages back to back and the server acks the last
+ * one with a byte. Without a way back the server times from the first message
+ * to the last.
+ */
+static double stream(struct chan *c, char *buf, size_t size, size_t msgs)
+{
+	uint64_t t = 0;
+	size_t i;
+	if (!c->server) {
+		t = now();
+		for (i = 0; i < msgs; i++)
+			send_msg(c, buf, size);
+		if (c->oneway)
+			return 0;
+		recv_msg(c, buf, 1);
+		return (double)size * msgs / ((now() - t) / 1000.0);
+	}
+	for (i = 0; i < msgs; i++) {
+		recv_msg(c, buf, size);
+		if (i == 0)
+			t = now();
+	}
+	if (!c->oneway) {
+		send_msg(c, buf, 1);
+		return 0;
+	}
+	if (msgs < 2)
+		return 0;
+	return (double)size * (msgs - 1) / ((now() - t) / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	struct chan c;
+	size_t *sizes = def_sizes, nsizes, maxsize = 0, total, msgs, i;
+	uint64_t *lat;
+	double mbs;
+	char *buf;
+	int opt, iters = 1000, bufsize = 0, n;
+	total = 64 << 20;
+	while ((opt = getopt(argc, argv, "n:t:b:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iters = atoi(optarg);
+				break;
+			case 't':
+				total = (size_t)atoi(optarg) << 20;
+				break;
+			case 'b':
+				bufsize = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (iters < 1 || total == 0)
+		usage();
+	n = chan_open(&c, argc, argv, bufsize);
+	argc -= n;
+	argv += n;
+	nsizes = sizeof(def_sizes) / sizeof(def_sizes[0]);
+	if (argc > 0) {
+		nsizes = argc;
+		if ((sizes = malloc(nsizes * sizeof(*sizes))) == NULL)
+			die("malloc");
+		for (i = 0; i < nsizes; i++)
+			if ((sizes[i] = strtoul(argv[i], NULL, 0)) == 0)
+				usage();
+	}
+	for (i = 0; i < nsizes; i++)
+		if (sizes[i] > maxsize)
+			maxsize = sizes[i];
+	if ((buf = malloc(maxsize)) == NULL ||
+			(lat = malloc(iters * sizeof(*lat))) == NULL)
+		die("malloc");
+	memset(buf, 'a', maxsize);
+	if (c.server == c.oneway)
+		print_header();
+	for (i = 0; i < nsizes; i++) {
+		msgs = total / sizes[i];
+		if (msgs > MAX_MSGS)
+			msgs = MAX_MSGS;
+		if (msgs == 0)
+			msgs = 1;
+		if (!c.oneway)
+			pingpong(&c, buf, sizes[i], iters, lat);
+		mbs = stream(&c, buf, sizes[i], msgs);
+		//only one side has the numbers
+		if (c.server == c.oneway)
+			print_row(sizes[i], msgs, c.oneway ? NULL : lat,
+					iters, mbs);
+	}
+	chan_close(&c);
+	free(lat);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,829 @@
+/*
+ * my_pipe for Linux processes on the host, see libmypipe.h. The pipe
+ * protocol is the one of sys_my_pipe.c and subr_my_shm.c, keep them in sync.
+ * The allocator and the record format come from my_pipe_shm.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libmypipe.h"
+
+static inline void mp_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause");
+#endif
+}
+
+static void mp_lock(uint8_t *lock)
+{
+	while (__sync_val_compare_and_swap(lock, 0, 1) == 1)
+		mp_pause();
+}
+
+static void mp_unlock(uint8_t *lock)
+{
+	__sync_lock_release(lock);
+}
+
+static inline struct my_shm_sb *mp_sb(struct mypipe_shm *shm)
+{
+	return (struct my_shm_sb *)shm->base;
+}
+
+/*
+ * The buffer of the pipe and its length. The control block is written by the
+ * guests, NULL and EIO if it does not describe a buffer in the shared memory.
+ */
+static uint8_t *mp_rbuf(struct mypipe *p, uint32_t *len)
+{
+	uint32_t off = shm_load(p->ctl->buf);
+	*len = shm_load(p->ctl->len);
+	if (!my_pipe_ctl_ok(off, *len, p->shm->len)) {
+		errno = EIO;
+		return NULL;
+	}
+	return p->shm->base + off;
+}
+
+/*
+ * Is the memory set up by a unikernel with our layout?
+ */
+static int mp_check(struct mypipe_shm *shm)
+{
+	struct my_shm_sb *sb = mp_sb(shm);
+	if (shm->len < MY_SHM_SB_SIZE ||
+			shm_load_acq(sb->magic) != MY_SHM_MAGIC) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (shm_load(sb->version) != MY_SHM_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+static int mp_map(struct mypipe_shm *shm, int fd)
+{
+	struct stat st;
+	void *p;
+	if (fstat(fd, &st) < 0)
+		return -1;
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	shm->base = p;
+	shm->len = st.st_size;
+	return 0;
+}
+
+static void mp_init(struct mypipe_shm *shm)
+{
+	memset(shm, 0, sizeof(*shm));
+	shm->sock = -1;
+	shm->peer = -1;
+	shm->self_ev = -1;
+}
+
+/*
+ * Map the shared memory file of ivshmem-plain, without doorbells
+ */
+int mypipe_shm_open(struct mypipe_shm *shm, const char *path)
+{
+	int fd, ret;
+	mp_init(shm);
+	if ((fd = open(path, O_RDWR)) < 0)
+		return -1;
+	ret = mp_map(shm, fd);
+	close(fd);
+	if (ret == 0 && (ret = mp_check(shm)) < 0)
+		mypipe_shm_close(shm);
+	return ret;
+}
+
+/*
+ * Receive one message of ivshmem-server: a 64 bit value and maybe a
+ * descriptor
+ */
+static int mp_recv(int sock, int64_t *val, int *fd, int flags)
+{
+	union {
+		struct cmsghdr	cmsg;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	iov.iov_base = val;
+	iov.iov_len = sizeof(*val);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	n = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return -1;
+	if (n != sizeof(*val)) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	*fd = -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return 0;
+}
+
+/*
+ * A peer came (with one eventfd per vector, we only use vector 0) or left
+ * (without a descriptor)
+ */
+static int mp_peer_msg(struct mypipe_shm *shm, int64_t id, int fd)
+{
+	int *ev, i;
+	if (id < 0 || id > 0xffff) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	if (id == shm->peer) {
+		if (fd >= 0 && shm->self_ev < 0)
+			shm->self_ev = fd;
+		else if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	if (id >= shm->npeers) {
+		if (fd < 0)
+			return 0;
+		ev = realloc(shm->peer_ev, (id + 1) * sizeof(int));
+		if (ev == NULL) {
+			close(fd);
+			return -1;
+		}
+		for (i = shm->npeers; i <= id; i++)
+			ev[i] = -1;
+		shm->peer_ev = ev;
+		shm->npeers = id + 1;
+	}
+	if (fd < 0) {
+		if (shm->peer_ev[id] >= 0)
+			close(shm->peer_ev[id]);
+		shm->peer_ev[id] = -1;
+	} else if (shm->peer_ev[id] < 0) {
+		shm->peer_ev[id] = fd;
+	} else {
+		close(fd);
+	}
+	return 0;
+}
+
+/*
+ * Handle whatever ivshmem-server sent since the last time
+ */
+static void mp_server(struct mypipe_shm *shm)
+{
+	int64_t id;
+	int fd;
+	while (shm->sock >= 0) {
+		if (mp_recv(shm->sock, &id, &fd, MSG_DONTWAIT) < 0) {
+			/* the server left, keep the peers we know */
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				close(shm->sock);
+				shm->sock = -1;
+			}
+			return;
+		}
+		mp_peer_msg(shm, id, fd);
+	}
+}
+
+/*
+ * Become an ivshmem peer through the socket of ivshmem-server. The server
+ * sends the protocol version, our id, the shared memory, the eventfds of the
+ * other peers and finally ours.
+ */
+int mypipe_shm_connect(struct mypipe_shm *shm, const char *path)
+{
+	struct sockaddr_un sun;
+	int64_t val;
+	int fd;
+	mp_init(shm);
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	shm->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (shm->sock < 0)
+		return -1;
+	if (connect(shm->sock, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		goto fail;
+	if (mp_recv(shm->sock, &val, &fd, 0) < 0)
+		goto fail;
+	if (val != 0 || fd >= 0) {
+		/* a protocol we do not know */
+		if (fd >= 0)
+			close(fd);
+		errno = EPROTO;
+		goto fail;
+	}
+	if (mp_recv(shm->sock, &val, &fd, 0) < 0)
+		goto fail;
+	shm->peer = val;
+	if (mp_recv(shm->sock, &val, &fd, 0) < 0)
+		goto fail;
+	if (val != -1 || fd < 0) {
+		if (fd >= 0)
+			close(fd);
+		errno = EPROTO;
+		goto fail;
+	}
+	if (mp_map(shm, fd) < 0) {
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+	while (shm->self_ev < 0) {
+		if (mp_recv(shm->sock, &val, &fd, 0) < 0)
+			goto fail;
+		if (mp_peer_msg(shm, val, fd) < 0)
+			goto fail;
+	}
+	if (mp_check(shm) < 0)
+		goto fail;
+	return 0;
+fail:
+	mypipe_shm_close(shm);
+	return -1;
+}
+
+void mypipe_shm_close(struct mypipe_shm *shm)
+{
+	int i, err = errno;
+	if (shm->base != NULL)
+		munmap(shm->base, shm->len);
+	if (shm->sock >= 0)
+		close(shm->sock);
+	if (shm->self_ev >= 0)
+		close(shm->self_ev);
+	for (i = 0; i < shm->npeers; i++)
+		if (shm->peer_ev[i] >= 0)
+			close(shm->peer_ev[i]);
+	free(shm->peer_ev);
+	mp_init(shm);
+	errno = err;
+}
+
+/*
+ * The control block of the pipe in a slot of the directory, or NULL
+ */
+struct my_pipe_ctl *mypipe_slot(struct mypipe_shm *shm, int slot)
+{
+	uint32_t off;
+	if (slot < 0 || slot >= MY_SHM_NSLOTS)
+		return NULL;
+	off = shm_load(mp_sb(shm)->slots[slot]);
+	if (off < MY_SHM_SB_SIZE || off + MY_PIPE_CTL_SIZE > shm->len)
+		return NULL;
+	return (struct my_pipe_ctl *)(shm->base + off);
+}
+
+/*
+ * Ring a peer like the DOORBELL register does
+ */
+static void mp_ring(struct mypipe_shm *shm, int id)
+{
+	uint64_t one = 1;
+	int fd;
+	if (id == shm->peer) {
+		fd = shm->self_ev;
+	} else {
+		/* it may have come after we last looked */
+		if (id >= shm->npeers || shm->peer_ev[id] < 0)
+			mp_server(shm);
+		if (id >= shm->npeers || shm->peer_ev[id] < 0)
+			return;
+		fd = shm->peer_ev[id];
+	}
+	if (write(fd, &one, sizeof(one)) < 0)
+		/* a peer that left, it will be removed */;
+}
+
+/*
+ * Wake up the peers that sleep in the waiter slots, see pipe_wakeup()
+ */
+static void mp_wakeup(struct mypipe_shm *shm, uint32_t *waiters)
+{
+	uint32_t peer[MY_PIPE_NWAITERS];
+	int i, j;
+	if (shm->peer < 0)
+		return;
+	__sync_synchronize();
+	for (i = 0; i < MY_PIPE_NWAITERS; i++) {
+		peer[i] = shm_load(waiters[i]);
+		if (peer[i] == 0)
+			continue;
+		for (j = 0; j < i; j++)
+			if (peer[j] == peer[i])
+				break;
+		if (j == i)
+			mp_ring(shm, peer[i] - 1);
+	}
+}
+
+static int mp_can_read(struct my_pipe_ctl *ctl, uint32_t need)
+{
+	return shm_load(ctl->head) - shm_load(ctl->tail) >= need ||
+		shm_load(ctl->nwriters) == 0;
+}
+
+static int mp_can_write(struct my_pipe_ctl *ctl, uint32_t need)
+{
+	return shm_load(ctl->len) - (shm_load(ctl->prod_head) -
+			shm_load(ctl->tail)) >= need ||
+		shm_load(ctl->nreaders) == 0;
+}
+
+/*
+ * Wait until ready() is true, see pipe_wait(). We spin, then we sleep on our
+ * eventfd with our peer id in a waiter slot, or poll every millisecond
+ * without doorbells or a free slot.
+ */
+static int mp_wait(struct mypipe *p, uint32_t *waiters,
+		int (*ready)(struct my_pipe_ctl *, uint32_t), uint32_t need)
+{
+	struct mypipe_shm *shm = p->shm;
+	struct pollfd pfd[2];
+	uint32_t *waiter;
+	uint64_t val;
+	int i, ret;
+	for (i = 0; i < MYPIPE_SPIN; i++) {
+		if (ready(p->ctl, need))
+			return 0;
+		mp_pause();
+	}
+	waiter = NULL;
+	if (shm->peer >= 0) {
+		for (i = 0; i < MY_PIPE_NWAITERS; i++) {
+			if (__sync_bool_compare_and_swap(&waiters[i], 0,
+						shm->peer + 1)) {
+				waiter = &waiters[i];
+				break;
+			}
+		}
+	}
+	if (waiter == NULL) {
+		while (!ready(p->ctl, need))
+			if (usleep(1000) < 0 && errno == EINTR)
+				return -1;
+		return 0;
+	}
+	ret = 0;
+	for (;;) {
+		__sync_synchronize();
+		if (ready(p->ctl, need))
+			break;
+		pfd[0].fd = shm->self_ev;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = shm->sock;
+		pfd[1].events = POLLIN;
+		/* the timeout only guards against a peer that died */
+		if (poll(pfd, 2, 1000) < 0) {
+			if (errno == EINTR) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		if (pfd[0].revents & POLLIN)
+			if (read(shm->self_ev, &val, sizeof(val)) < 0)
+				/* somebody else drained it */;
+		if (pfd[1].revents)
+			mp_server(shm);
+	}
+	shm_store(*waiter, 0);
+	return ret;
+}
+
+/*
+ * Attach to the read (oper 0) or the write (oper 1) end of the pipe in slot
+ */
+int mypipe_open(struct mypipe *p, struct mypipe_shm *shm, int slot, int oper)
+{
+	struct my_pipe_ctl *ctl;
+	uint8_t *cnt;
+	int ret = 0;
+	if (oper != 0 && oper != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((ctl = mypipe_slot(shm, slot)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (!my_pipe_ctl_ok(shm_load(ctl->buf), shm_load(ctl->len), shm->len)) {
+		errno = EIO;
+		return -1;
+	}
+	cnt = oper == 0 ? &ctl->nreaders : &ctl->nwriters;
+	mp_lock(&ctl->lock);
+	if (ctl->nreaders == 0 && ctl->nwriters == 0) {
+		/* the last end is being closed */
+		errno = ENOENT;
+		ret = -1;
+	} else if (*cnt == UINT8_MAX) {
+		errno = EMFILE;
+		ret = -1;
+	} else {
+		shm_store(*cnt, *cnt + 1);
+	}
+	mp_unlock(&ctl->lock);
+	if (ret < 0)
+		return -1;
+	p->shm = shm;
+	p->ctl = ctl;
+	p->slot = slot;
+	p->oper = oper;
+	p->nonblock = 0;
+	return 0;
+}
+
+int mypipe_close(struct mypipe *p)
+{
+	struct mypipe_shm *shm = p->shm;
+	struct my_pipe_ctl *ctl = p->ctl;
+	uint8_t nreaders, nwriters;
+	uint32_t off, len;
+	mp_lock(&ctl->lock);
+	nreaders = ctl->nreaders;
+	nwriters = ctl->nwriters;
+	if (p->oper == 0)
+		shm_store_rel(ctl->nreaders, --nreaders);
+	else
+		shm_store_rel(ctl->nwriters, --nwriters);
+	mp_unlock(&ctl->lock);
+	mp_wakeup(shm, ctl->rd_waiters);
+	mp_wakeup(shm, ctl->wr_waiters);
+	if (nreaders == 0 && nwriters == 0) {
+		shm_store(mp_sb(shm)->slots[p->slot], 0);
+		my_pipe_bdrain(shm->base, shm->len, ctl);
+		off = shm_load(ctl->buf);
+		len = shm_load(ctl->len);
+		if (my_pipe_ctl_ok(off, len, shm->len))
+			my_shm_ext_free(shm->base, off, len);
+		my_shm_ext_free(shm->base, (uint8_t *)ctl - shm->base,
+				MY_PIPE_CTL_SIZE);
+	}
+	p->ctl = NULL;
+	return 0;
+}
+
+/*
+ * Copy the record at the tail of the ring buf to dst and consume it, what
+ * does not fit is thrown away. Called with rd_lock held and a record in the
+ * pipe. A header that a guest got wrong is EBADMSG.
+ */
+static ssize_t mp_read_rec(struct mypipe *p, uint8_t *buf, uint32_t len,
+		void *dst, size_t n)
+{
+	struct my_pipe_ctl *ctl = p->ctl;
+	uint32_t tail, rec, cnt, off, size;
+	tail = ctl->tail;
+	rec = my_pipe_rec_len(buf, len, tail);
+	if (!my_pipe_rec_ok(len, tail, shm_load_acq(ctl->head), rec)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	cnt = rec < n ? rec : n;
+	off = (tail + MY_PIPE_REC_HDR) & (len - 1);
+	size = len - off;
+	if (size > cnt)
+		size = cnt;
+	memcpy(dst, buf + off, size);
+	memcpy((uint8_t *)dst + size, buf, cnt - size);
+	shm_store_rel(ctl->tail, tail + MY_PIPE_REC_SIZE(rec));
+	return cnt;
+}
+
+ssize_t mypipe_read(struct mypipe *p, void *dst, size_t n)
+{
+	struct my_pipe_ctl *ctl = p->ctl;
+	size_t nread = 0, size;
+	ssize_t ret;
+	uint32_t len, head, tail, cnt;
+	uint8_t *buf;
+	if (p->oper != 0) {
+		errno = EBADF;
+		return -1;
+	}
+	mp_lock(&ctl->rd_lock);
+	while (nread < n) {
+		if ((buf = mp_rbuf(p, &len)) == NULL) {
+			mp_unlock(&ctl->rd_lock);
+			return -1;
+		}
+		tail = ctl->tail;
+		head = shm_load_acq(ctl->head);
+		if (head == tail) {
+			if (nread > 0)
+				break;
+			if (shm_load_acq(ctl->nwriters) == 0) {
+				/* the last writer may have published just
+				 * before it left, see my_pipe_read() */
+				if (shm_load_acq(ctl->head) == tail)
+					break;
+				continue;
+			}
+			if (p->nonblock) {
+				mp_unlock(&ctl->rd_lock);
+				errno = EAGAIN;
+				return -1;
+			}
+			mp_unlock(&ctl->rd_lock);
+			if (mp_wait(p, ctl->rd_waiters, mp_can_read, 1) < 0)
+				return -1;
+			mp_lock(&ctl->rd_lock);
+			continue;
+		}
+		if (shm_load(ctl->flags) & MY_PIPE_F_PACKET) {
+			/* a buffer is left for mypipe_brecv(), see
+			 * my_pipe_read() */
+			if (my_pipe_rec_type(buf, len, tail) == MY_PIPE_REC_BUF) {
+				mp_unlock(&ctl->rd_lock);
+				errno = ENOMSG;
+				return -1;
+			}
+			ret = mp_read_rec(p, buf, len, dst, n);
+			mp_unlock(&ctl->rd_lock);
+			if (ret >= 0)
+				mp_wakeup(p->shm, ctl->wr_waiters);
+			return ret;
+		}
+		cnt = head - tail;
+		size = len - (tail & (len - 1));
+		if (size > cnt)
+			size = cnt;
+		if (size > n - nread)
+			size = n - nread;
+		memcpy((uint8_t *)dst + nread, buf + (tail & (len - 1)), size);
+		shm_store_rel(ctl->tail, tail + size);
+		mp_wakeup(p->shm, ctl->wr_waiters);
+		nread += size;
+	}
+	mp_unlock(&ctl->rd_lock);
+	return nread;
+}
+
+/*
+ * Publish the n bytes reserved at idx, see pipe_publish()
+ */
+static void mp_publish(struct my_pipe_ctl *ctl, uint32_t idx, uint32_t n)
+{
+	int cnt;
+	for (cnt = 0; !my_pipe_can_publish(ctl, idx); cnt++) {
+		if (cnt < MYPIPE_SPIN)
+			mp_pause();
+		else
+			usleep(1000);
+	}
+	shm_store_rel(ctl->head, idx + n);
+}
+
+/*
+ * Write n bytes, see pipe_write(). In packet mode they are one record of the
+ * given type.
+ */
+static ssize_t mp_write(struct mypipe *p, uint32_t type, const void *src,
+		size_t n)
+{
+	struct my_pipe_ctl *ctl = p->ctl;
+	size_t put = 0, need, want;
+	uint32_t len, idx, res, off, size, hdr, cnt;
+	uint8_t *buf;
+	if (p->oper != 1) {
+		errno = EBADF;
+		return -1;
+	}
+	need = n <= MYPIPE_PIPE_BUF ? n : 1;
+	while (put < n) {
+		if (shm_load(ctl->nreaders) == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		my_pipe_wr_enter(ctl);
+		want = n - put < UINT32_MAX ? n - put : UINT32_MAX;
+		if ((buf = mp_rbuf(p, &len)) == NULL) {
+			my_pipe_wr_exit(ctl);
+			return -1;
+		}
+		hdr = 0;
+		if (shm_load(ctl->flags) & MY_PIPE_F_PACKET) {
+			if (n > len - MY_PIPE_REC_HDR) {
+				my_pipe_wr_exit(ctl);
+				errno = EMSGSIZE;
+				return -1;
+			}
+			hdr = MY_PIPE_REC_HDR;
+			need = want = MY_PIPE_REC_SIZE(n);
+		} else if (type != MY_PIPE_REC_DATA) {
+			my_pipe_wr_exit(ctl);
+			errno = EINVAL;
+			return -1;
+		}
+		res = my_pipe_reserve(ctl, need, want, 0, &idx);
+		if (res == 0) {
+			my_pipe_wr_exit(ctl);
+			if (p->nonblock) {
+				if (put > 0)
+					break;
+				errno = EAGAIN;
+				return -1;
+			}
+			if (mp_wait(p, ctl->wr_waiters, mp_can_write, need) < 0) {
+				if (put > 0)
+					break;
+				return -1;
+			}
+			continue;
+		}
+		cnt = res;
+		if (hdr && idx % MY_PIPE_REC_ALIGN != 0) {
+			/* a guest moved prod_head off the records, a header
+			 * there would wrap */
+			mp_publish(ctl, idx, res);
+			my_pipe_wr_exit(ctl);
+			errno = EIO;
+			return -1;
+		}
+		if (hdr) {
+			cnt = n;
+			my_pipe_rec_put(buf, len, idx, cnt, type);
+		}
+		off = (idx + hdr) & (len - 1);
+		size = len - off;
+		if (size > cnt)
+			size = cnt;
+		memcpy(buf + off, (const uint8_t *)src + put, size);
+		memcpy(buf, (const uint8_t *)src + put + size, cnt - size);
+		mp_publish(ctl, idx, res);
+		my_pipe_wr_exit(ctl);
+		mp_wakeup(p->shm, ctl->rd_waiters);
+		put += cnt;
+		need = 1;
+	}
+	return put;
+}
+
+ssize_t mypipe_write(struct mypipe *p, const void *src, size_t n)
+{
+	return mp_write(p, MY_PIPE_REC_DATA, src, n);
+}
+
+/*
+ * Turn packet mode on or off while the pipe is empty, see pipe_setpkt()
+ */
+int mypipe_setpkt(struct mypipe *p, int on)
+{
+	struct my_pipe_ctl *ctl = p->ctl;
+	uint32_t idx;
+	int ret = 0;
+	mp_lock(&ctl->wr_lock);
+	while (__atomic_load_n(&ctl->wr_active, __ATOMIC_SEQ_CST) != 0)
+		mp_pause();
+	mp_lock(&ctl->rd_lock);
+	if (ctl->head != ctl->tail) {
+		errno = EBUSY;
+		ret = -1;
+		goto out;
+	}
+	idx = (ctl->head + MY_PIPE_REC_ALIGN - 1) & ~(MY_PIPE_REC_ALIGN - 1);
+	shm_store(ctl->prod_head, idx);
+	shm_store(ctl->head, idx);
+	shm_store(ctl->tail, idx);
+	if (on)
+		shm_store(ctl->flags, ctl->flags | MY_PIPE_F_PACKET);
+	else
+		shm_store(ctl->flags, ctl->flags & ~MY_PIPE_F_PACKET);
+out:
+	mp_unlock(&ctl->rd_lock);
+	mp_unlock(&ctl->wr_lock);
+	return ret;
+}
+
+void *mypipe_balloc(struct mypipe_shm *shm, uint32_t len)
+{
+	uint32_t off;
+	if (len == 0 || len > MY_SHM_BUF_CAP(MY_SHM_NCLASSES - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((off = my_shm_buf_alloc(shm->base, shm->len, len)) == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return shm->base + off;
+}
+
+int mypipe_bsend(struct mypipe *p, void *addr, uint32_t len)
+{
+	struct my_pipe_desc desc;
+	desc.off = (uint8_t *)addr - p->shm->base;
+	desc.len = len;
+	if (len == 0 || my_shm_buf_class(p->shm->base, p->shm->len, desc.off,
+				len) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return mp_write(p, MY_PIPE_REC_BUF, &desc, sizeof(desc)) < 0 ? -1 : 0;
+}
+
+/*
+ * Take the next buffer out of the pipe, *len is 0 at EOF. The next record
+ * must be a buffer, else ENOMSG and it is left for mypipe_read().
+ */
+int mypipe_brecv(struct mypipe *p, void **addr, uint32_t *len)
+{
+	struct my_pipe_ctl *ctl = p->ctl;
+	struct my_pipe_desc desc;
+	uint32_t rlen, tail;
+	uint8_t *buf;
+	if (p->oper != 0) {
+		errno = EBADF;
+		return -1;
+	}
+	*addr = NULL;
+	*len = 0;
+	mp_lock(&ctl->rd_lock);
+	for (;;) {
+		if (!(shm_load(ctl->flags) & MY_PIPE_F_PACKET)) {
+			errno = EINVAL;
+			goto fail;
+		}
+		tail = ctl->tail;
+		if (shm_load_acq(ctl->head) != tail)
+			break;
+		if (shm_load_acq(ctl->nwriters) == 0) {
+			if (shm_load_acq(ctl->head) != tail)
+				break;
+			mp_unlock(&ctl->rd_lock);
+			return 0;
+		}
+		if (p->nonblock) {
+			errno = EAGAIN;
+			goto fail;
+		}
+		mp_unlock(&ctl->rd_lock);
+		if (mp_wait(p, ctl->rd_waiters, mp_can_read, 1) < 0)
+			return -1;
+		mp_lock(&ctl->rd_lock);
+	}
+	if ((buf = mp_rbuf(p, &rlen)) == NULL)
+		goto fail;
+	if (my_pipe_rec_type(buf, rlen, tail) != MY_PIPE_REC_BUF) {
+		errno = ENOMSG;
+		goto fail;
+	}
+	memset(&desc, 0, sizeof(desc));
+	if (mp_read_rec(p, buf, rlen, &desc, sizeof(desc)) < 0)
+		goto fail;
+	mp_unlock(&ctl->rd_lock);
+	mp_wakeup(p->shm, ctl->wr_waiters);
+	/* a guest wrote the record, see pipe_brecv() */
+	if (desc.len == 0 || my_shm_buf_class(p->shm->base, p->shm->len,
+				desc.off, desc.len) < 0) {
+		errno = EBADMSG;
+		return -1;
+	}
+	*addr = p->shm->base + desc.off;
+	*len = desc.len;
+	return 0;
+fail:
+	mp_unlock(&ctl->rd_lock);
+	return -1;
+}
+
+int mypipe_bfree(struct mypipe_shm *shm, void *addr, uint32_t len)
+{
+	uint32_t off = (uint8_t *)addr - shm->base;
+	if (len == 0 || my_shm_buf_class(shm->base, shm->len, off, len) < 0 ||
+			my_shm_buf_free(shm->base, shm->len, off) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef _LIBMYPIPE_H_
+#define _LIBMYPIPE_H_
+
+/*
+ * my_pipe for ordinary Linux processes on the host. The process maps the
+ * same shared memory as the unikernels (the memory-backend-file of
+ * ivshmem-plain, or the memory that ivshmem-server hands out) and attaches to
+ * a pipe that a unikernel created, by its slot in the directory of the
+ * superblock. Reads and writes follow the same protocol as sys_my_pipe.c, so
+ * the host can be a reader or a writer next to the unikernels.
+ *
+ * Connected to the ivshmem-server the process is an ivshmem peer too. It
+ * sleeps on its eventfd and rings the unikernels through theirs, exactly
+ * like a doorbell. Without the server it polls, like ivshmem-plain guests.
+ *
+ * Functions return -1 and set errno on error, like the system calls. The
+ * guests are not trusted: a control block that points outside the shared
+ * memory fails with EIO and a bad record with EBADMSG.
+ */
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "../my_pipe_shm.h"
+
+#define	MYPIPE_PIPE_BUF		512		/* PIPE_BUF of the unikernels,
+						   smaller writes are atomic */
+#define	MYPIPE_SPIN		2000		/* spins before sleeping */
+
+/*
+ * The shared memory and, with ivshmem-server, the doorbells
+ */
+struct mypipe_shm {
+	uint8_t		*base;		/* start of shared memory */
+	size_t		len;		/* size of shared memory */
+	int		sock;		/* ivshmem-server socket or -1 */
+	int		peer;		/* our peer id, -1 without server */
+	int		self_ev;	/* eventfd the peers ring us on */
+	int		*peer_ev;	/* eventfd of every peer, -1 if gone */
+	int		npeers;		/* size of peer_ev */
+};
+
+/*
+ * One end of a pipe
+ */
+struct mypipe {
+	struct mypipe_shm	*shm;
+	struct my_pipe_ctl	*ctl;	/* control block */
+	int			slot;	/* slot in directory */
+	int			oper;	/* 0 for read, 1 for write end */
+	int			nonblock; /* fail with EAGAIN, do not wait */
+};
+
+int mypipe_shm_open(struct mypipe_shm *shm, const char *path);
+int mypipe_shm_connect(struct mypipe_shm *shm, const char *path);
+void mypipe_shm_close(struct mypipe_shm *shm);
+struct my_pipe_ctl *mypipe_slot(struct mypipe_shm *shm, int slot);
+
+int mypipe_open(struct mypipe *p, struct mypipe_shm *shm, int slot, int oper);
+int mypipe_close(struct mypipe *p);
+ssize_t mypipe_read(struct mypipe *p, void *buf, size_t n);
+ssize_t mypipe_write(struct mypipe *p, const void *buf, size_t n);
+int mypipe_setpkt(struct mypipe *p, int on);
+
+/* zero-copy buffers, like MY_PIPE_BALLOC/BSEND/BRECV/BFREE. mypipe_read()
+ * stops at a buffer with ENOMSG. */
+void *mypipe_balloc(struct mypipe_shm *shm, uint32_t len);
+int mypipe_bsend(struct mypipe *p, void *addr, uint32_t len);
+int mypipe_brecv(struct mypipe *p, void **addr, uint32_t *len);
+int mypipe_bfree(struct mypipe_shm *shm, void *addr, uint32_t len);
+
+#endif /* _LIBMYPIPE_H_ */
@@ -0,0 +1,144 @@
+/*
+ * Feed a my_pipe of the unikernels from the host or drain it
+ *
+ *	mypipe [-f file | -s socket] [-n] ls
+ *	mypipe [-f file | -s socket] [-n] cat slot	pipe to stdout
+ *	mypipe [-f file | -s socket] [-n] put slot	stdin to pipe
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libmypipe.h"
+
+#define	SHM_FILE	"/dev/shm/ivshmem"	/* mem-path of the README */
+#define	CHUNK		65536
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mypipe [-f file | -s socket] [-n] ls\n"
+			"       mypipe [-f file | -s socket] [-n] cat|put slot\n");
+	exit(1);
+}
+
+//list the pipes in the directory of the superblock
+static void list_pipes(struct mypipe_shm *shm)
+{
+	struct my_pipe_ctl *ctl;
+	int slot;
+	printf("slot\tsize\tbytes\treaders\twriters\tmode\n");
+	for (slot = 0; slot < MY_SHM_NSLOTS; slot++) {
+		if ((ctl = mypipe_slot(shm, slot)) == NULL)
+			continue;
+		printf("%d\t%u\t%u\t%u\t%u\t%s\n", slot, shm_load(ctl->len),
+				shm_load(ctl->head) - shm_load(ctl->tail),
+				shm_load(ctl->nreaders), shm_load(ctl->nwriters),
+				shm_load(ctl->flags) & MY_PIPE_F_PACKET ?
+				"packet" : "stream");
+	}
+}
+
+//copy the pipe to stdout until all the writers leave
+static int cat_pipe(struct mypipe *p, char *buf)
+{
+	ssize_t n;
+	while ((n = mypipe_read(p, buf, CHUNK)) > 0) {
+		if (fwrite(buf, 1, n, stdout) != (size_t)n) {
+			perror("fwrite");
+			return 1;
+		}
+	}
+	fflush(stdout);
+	if (n < 0) {
+		perror("mypipe_read");
+		return 1;
+	}
+	return 0;
+}
+
+//copy stdin to the pipe, in packet mode every chunk becomes a record
+static int put_pipe(struct mypipe *p, char *buf)
+{
+	size_t chunk = CHUNK;
+	ssize_t n;
+	if (shm_load(p->ctl->flags) & MY_PIPE_F_PACKET &&
+			shm_load(p->ctl->len) - MY_PIPE_REC_HDR < chunk)
+		chunk = shm_load(p->ctl->len) - MY_PIPE_REC_HDR;
+	while ((n = read(0, buf, chunk)) > 0) {
+		if (mypipe_write(p, buf, n) != n) {
+			perror("mypipe_write");
+			return 1;
+		}
+	}
+	if (n < 0) {
+		perror("read");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct mypipe_shm shm;
+	struct mypipe p;
+	const char *file = SHM_FILE, *sock = NULL;
+	char *buf;
+	int opt, nonblock = 0, slot, oper, ret;
+	while ((opt = getopt(argc, argv, "f:s:n")) != -1) {
+		switch (opt) {
+			case 'f':
+				file = optarg;
+				break;
+			case 's':
+				sock = optarg;
+				break;
+			case 'n':
+				nonblock = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+	if (sock != NULL)
+		ret = mypipe_shm_connect(&shm, sock);
+	else
+		ret = mypipe_shm_open(&shm, file);
+	if (ret < 0) {
+		perror(sock != NULL ? sock : file);
+		return 1;
+	}
+	if (strcmp(argv[0], "ls") == 0) {
+		list_pipes(&shm);
+		mypipe_shm_close(&shm);
+		return 0;
+	}
+	if (argc != 2)
+		usage();
+	if (strcmp(argv[0], "cat") == 0)
+		oper = 0;
+	else if (strcmp(argv[0], "put") == 0)
+		oper = 1;
+	else
+		usage();
+	slot = atoi(argv[1]);
+	if (mypipe_open(&p, &shm, slot, oper) < 0) {
+		perror("mypipe_open");
+		return 1;
+	}
+	p.nonblock = nonblock;
+	if ((buf = malloc(CHUNK)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	ret = oper == 0 ? cat_pipe(&p, buf) : put_pipe(&p, buf);
+	free(buf);
+	mypipe_close(&p);
+	mypipe_shm_close(&shm);
+	return ret;
+}
@@ -35,13 +35,13 @@ struct ivshmem_softc {
 	bus_addr_t		data_base; 
 	bus_dma_tag_t           dma_tag;
         /* irq handling */
-	pci_intr_handle_t       *ihp;
-	unsigned int		irq;
+	void			*ih;
 };
 
 static int ivshmem_match(device_t dev, cfdata_t cf, void *v);
 static void ivshmem_attach(device_t parent, device_t self, void *);
 static int ivshmem_detach(device_t dev, int flags);
+static int ivshmem_intr(void *arg);
 
 CFATTACH_DECL_NEW(ivshmem, sizeof(struct ivshmem_softc), ivshmem_match, 
 		ivshmem_attach, ivshmem_detach, NULL);
@@ -71,12 +71,13 @@ static void ivshmem_attach(device_t parent, device_t self, void *v)
 	struct pci_attach_args *pa = (struct pci_attach_args *) v;
 	//int revision = PCI_REVISION(pa->pa_class);
 	struct ivshmem_softc *sc = device_private(self);
-	//pci_intr_handle_t ih;
+	pci_intr_handle_t ih;
 	bus_space_tag_t iot;
 	bus_space_handle_t ioh;
 	bus_addr_t iobase; 
 	bus_size_t iosize; 
-	//char intrbuf[PCI_INTRSTR_LEN];
+	const char *intrstr;
+	char intrbuf[PCI_INTRSTR_LEN];
 	pci_chipset_tag_t pc = pa->pa_pc;
 	pcitag_t tag = pa->pa_tag;
 	//pcireg_t csr;
@@ -90,18 +91,23 @@ static void ivshmem_attach(device_t parent, device_t self, void *v)
 	sc->dev = self;
 	sc->pc = pc;
 	sc->tag = tag;
-	//if (pci_mapreg_map(pa, PCI_BAR(0), PCI_MAPREG_TYPE_MEM, 0, &iot, 
-	//			&ioh, NULL, &iosize)) {
-	//	aprint_error_dev(self, "can't map reg\n");
-	//	return;
-	//}
-	//sc->reg_tag = iot;
-	//sc->reg_handle = ioh;
-	//sc->reg_size = iosize;
+	sharme.peer = -1;
+	if (pci_mapreg_map(pa, PCI_BAR(0), PCI_MAPREG_TYPE_MEM, 0, &iot, 
+				&ioh, NULL, &iosize)) {
+		aprint_error_dev(self, "can't map reg\n");
+		return;
+	}
+	sc->reg_tag = iot;
+	sc->reg_handle = ioh;
+	sc->reg_size = iosize;
+	sharme.reg_t = iot;
+	sharme.reg_h = ioh;
 
-	/* data region */
-	if (pci_mapreg_map(pa, PCI_BAR(2), PCI_MAPREG_TYPE_MEM, 0, &iot, 
-				&ioh, &iobase, &iosize)) {
+	/* data region, it is plain RAM on the host so we map it cacheable
+	 * and use it through pointers */
+	if (pci_mapreg_map(pa, PCI_BAR(2), PCI_MAPREG_TYPE_MEM, 
+				BUS_SPACE_MAP_LINEAR | BUS_SPACE_MAP_CACHEABLE,
+				&iot, &ioh, &iobase, &iosize)) {
 		aprint_error_dev(self, "can't map data\n");
 		return;
 	}
@@ -111,29 +117,75 @@ static void ivshmem_attach(device_t parent, device_t self, void *v)
 	sc->data_base = iobase;
 	/* initialize ivshm struct */
 	sharme.data_s = iosize;
-	sharme.data_b = iobase;
+	sharme.data_b = bus_space_vaddr(iot, ioh);
 	sharme.data_t = iot;
 	sharme.data_h = ioh;
-	/* interrupts */
+	/* new pipes get the biggest power of 2 that is at most 1/16 of the
+	 * shared memory, MY_PIPE_SETSZ changes it per pipe */
+	for (sharme.pipe_size = MY_PIPE_BUF_SIZE; 
+			sharme.pipe_size * 2 <= iosize / 16; 
+			sharme.pipe_size *= 2)
+		/* do nothing */;
+	mutex_init(&sharme.intr_lock, MUTEX_DEFAULT, IPL_VM);
+	cv_init(&sharme.intr_cv, "mypipe");
+	my_pipe_init();
+	/* interrupts, rump only gives us INTx so the doorbell device must
+	 * be started with msi=off */
+	if (pci_intr_map(pa, &ih)) {
+		aprint_error_dev(self, "can't map interrupt\n");
+		return;
+	}
+	intrstr = pci_intr_string(pc, ih, intrbuf, sizeof(intrbuf));
+	sc->ih = pci_intr_establish(pc, ih, IPL_VM, ivshmem_intr, sc);
+	if (sc->ih == NULL) {
+		aprint_error_dev(self, "can't establish interrupt\n");
+		return;
+	}
+	aprint_normal_dev(self, "interrupting at %s\n", intrstr);
+	bus_space_write_4(sc->reg_tag, sc->reg_handle, IVSHMEM_INTRMASK, 
+			0xffffffff);
+	/* ivshmem-plain has no peer id, pipes will spin there */
+	sharme.peer = (int32_t)bus_space_read_4(sc->reg_tag, sc->reg_handle, 
+			IVSHMEM_IVPOSITION);
 	return;
 }
 
+/*
+ * A peer rang our doorbell, wake up everyone that sleeps or polls on a pipe
+ * and let them check their pipe again
+ */
+static int ivshmem_intr(void *arg)
+{
+	struct ivshmem_softc *sc = arg;
+	/* reading the status also acknowledges the interrupt */
+	if (bus_space_read_4(sc->reg_tag, sc->reg_handle, 
+				IVSHMEM_INTRSTATUS) == 0)
+		return 0;
+	my_pipe_intr();
+	return 1;
+}
+
 /* Detach device. */
 
 static int ivshmem_detach(device_t dev, int flags)
 {
 	struct ivshmem_softc *sc = device_private(dev);
 	printf("IVSHMEM: Hello from ivshmem_detach\n");
-	//if (sc->reg_size) {
-	//	bus_space_unmap(sc->reg_tag, sc->reg_handle, sc->reg_size);
-	//	sc->reg_size = 0;
-	//}
+	if (sc->ih) {
+		pci_intr_disestablish(sc->pc, sc->ih);
+		sc->ih = NULL;
+		sharme.peer = -1;
+	}
+	if (sc->reg_size) {
+		bus_space_unmap(sc->reg_tag, sc->reg_handle, sc->reg_size);
+		sc->reg_size = 0;
+	}
 	/* Teardown the state in our softc created in our attach routine. */
 	if (sc->data_size) {
 		bus_space_unmap(sc->data_tag, sc->data_handle, sc->data_size);
 		sc->data_size = 0;
 		sharme.data_s = 0;
-		sharme.data_b = 0;
+		sharme.data_b = NULL;
 		sharme.data_t = 0;
 		sharme.data_h = 0;
 	}
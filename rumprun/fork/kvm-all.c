@@ -19,6 +19,7 @@
 #include <linux/kvm.h>
 
 #include "qemu-common.h"
+#include "cpu.h"
 #include "qemu/atomic.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
@@ -41,7 +42,7 @@
 
 #include "hw/boards.h"
 
-#include "io/channel-command.h"
+#include "io/channel-socket.h"
 #include "migration/savevm.h"
 #include "migration/migration.h"
 #include "migration/channel.h"
@@ -63,6 +64,9 @@
 #ifdef CONFIG_EVENTFD
 #include <sys/eventfd.h>
 #endif
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
 
 /* KVM uses PAGE_SIZE in its definition of KVM_COALESCED_MMIO_MAX. We
  * need to use the real host PAGE_SIZE, as that's what KVM will use.
@@ -149,16 +153,14 @@ static const KVMCapabilityInfo kvm_required_capabilites[] = {
     KVM_CAP_LAST_INFO
 };
 
-char **execve_argv(void);
-void check_migration(void *data);
-void my_fork(void *data);
-void my_start_migration(void *data);
-void my_exec_start_outgoing_migration(MigrationState *s, const char *command, Error **errp);
+char **execve_argv(int fd);
+void my_fork(CPUState *cpu, void *data);
 void my_migration_channel_connect(MigrationState *s,
                                QIOChannel *ioc,
                                const char *hostname);
 void my_migrate_fd_connect(MigrationState *s);
 static void *my_migration_thread(void *opaque);
+static void my_fork_release(bool ok);
 static void migration_completion(MigrationState *s, int current_active_state,
                                  bool *old_vm_running,
                                  int64_t *start_time);
@@ -170,7 +172,79 @@ static NotifierList migration_state_notifiers =
 static void migrate_fd_cleanup(void *opaque);
 static void block_cleanup_parameters(MigrationState *s);
 static void migrate_set_block_incremental(MigrationState *s, bool value);
-unsigned int my_cnt = 0;
+void my_fork_stamp(const char *stage);
+void my_fork_exec_stamp(void);
+void my_fork_set_opts(const char *str);
+void my_fork_init(void);
+static uint32_t my_fork_id;		/* fork the guest is doing */
+static pid_t my_child_pid;		/* qemu of the child, it is spawned
+					   when the migration starts */
+static int my_fork_log = -2;		/* fd of MY_FORK_LOG, -1 without it and
+					   -2 before we look */
+static CPUState *my_fork_cpu;		/* vcpu parked in the fork hypercall,
+					   NULL if there is no fork */
+static bool my_fork_child;		/* a child that has not told us its
+					   fork id yet */
+
+/* -fork-opts of the command line */
+static struct {
+	int		zygotes;	/* child qemus that wait ready */
+	int		ram;		/* ram=, one of MY_FORK_RAM_* */
+	char		*ram_id;	/* ram-id, the RAMBlock of guest ram */
+	bool		live;		/* snapshot=live, pre-copy with ram=copy */
+	uint64_t	bandwidth;	/* bytes/s of the snapshot, 0 unlimited */
+	uint64_t	downtime;	/* ms, when snapshot=live completes */
+	uint64_t	buffer;		/* socket buffers to the child, 0 for
+					   the default of the host */
+	int		threads;	/* of the parallel snapshot, 0 for one
+					   per host core */
+} my_fork_opts = {
+	.downtime = 300,
+};
+#define	MY_FORK_RAM_COPY	0	/* ram goes in the migration stream */
+#define	MY_FORK_RAM_SHARED	1	/* copy-on-write over a file */
+#define	MY_FORK_RAM_LAZY	2	/* the child faults ram in later */
+#define	MY_FORK_MAX_THREADS	64
+static bool my_cow_private;		/* guest ram is MAP_PRIVATE already */
+static int *my_fork_chans;		/* our ends of the channels of the fork
+					   in progress */
+
+/*
+ * A child qemu that is already up, waiting on its end of a socketpair (with
+ * -incoming, or in my_fork_init) for a fork to migrate into it
+ */
+struct my_zygote {
+	pid_t		pid;
+	int		fd;		/* our end of the socketpair */
+	int		*chans;		/* and of the channels, if any */
+};
+static struct my_zygote *my_zygotes;	/* the pool */
+static int my_nzygotes;			/* zygotes in the pool */
+static QemuMutex my_zygote_lock;	/* vcpu takes, main loop refills */
+static QEMUBH *my_zygote_bh;		/* refills the pool */
+
+/* ram=copy with snapshot=stop and more threads than one, the parallel
+ * snapshot */
+static bool my_fork_parallel(void)
+{
+	return my_fork_opts.ram == MY_FORK_RAM_COPY && !my_fork_opts.live &&
+		my_fork_opts.threads > 1;
+}
+
+/* the channels of a child, next to its socketpair */
+static int my_fork_nchans(void)
+{
+	if (my_fork_opts.ram == MY_FORK_RAM_LAZY)
+		return 1;
+	return my_fork_parallel() ? my_fork_opts.threads : 0;
+}
+
+/* the snapshot is ours and not the migration stream, the child loads it in
+ * my_fork_init and has no -incoming */
+static bool my_fork_own_snapshot(void)
+{
+	return my_fork_opts.ram != MY_FORK_RAM_COPY || my_fork_parallel();
+}
 
 int kvm_get_max_memslots(void)
 {
@@ -2070,6 +2144,890 @@ fail:
                       MIGRATION_STATUS_FAILED);
 }
 
+/* 
+ * Copy-on-write fork, -fork-opts ram=shared. Guest ram is a file (the
+ * memory-backend-file with id=ram-id, or -mem-path). The first fork maps it
+ * MAP_PRIVATE, so from then on the file is a frozen image that the parent and
+ * every child map MAP_PRIVATE and the host copies pages on write. A fork only
+ * sends the pages the parent has its own copy of, the other ram blocks that
+ * are not shared (roms and the like, they are small) and the device state:
+ *
+ *	{ u8 len, idstr, be64 offset, be64 length, data } ... u8 0
+ *	qemu_save_device_state()
+ *
+ * The child reads it in my_fork_cow_load, before the vm starts.
+ */
+#define	PM_PRESENT	(1ULL << 63)	/* bits of /proc/self/pagemap */
+#define	PM_SWAP		(1ULL << 62)
+#define	PM_FILE		(1ULL << 61)	/* file page or shared anon */
+#define	PM_BATCH	512		/* entries we read in one go */
+
+static void my_cow_put(QEMUFile *f, const char *idstr, uint8_t *host, 
+		uint64_t off, uint64_t len)
+{
+	size_t n = strlen(idstr);
+	qemu_put_byte(f, n);
+	qemu_put_buffer(f, (const uint8_t *)idstr, n);
+	qemu_put_be64(f, off);
+	qemu_put_be64(f, len);
+	qemu_put_buffer(f, host + off, len);
+}
+
+/* map the file of rb MAP_PRIVATE in place of whatever rb->host has now */
+static int my_cow_remap(RAMBlock *rb)
+{
+	void *p = mmap(rb->host, rb->max_length, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_FIXED, rb->fd, 0);
+	if (p == MAP_FAILED) {
+		error_report("fork: remap %s: %s", rb->idstr, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send the pages of rb we have our own copy of, the rest are in the file. In
+ * a MAP_PRIVATE file mapping these are the pages that are present or swapped
+ * and are not file pages.
+ */
+static int my_cow_send_private(QEMUFile *f, RAMBlock *rb)
+{
+	uint64_t ent[PM_BATCH], psize = getpagesize();
+	uint64_t npages = rb->used_length / psize, i, j, n, start = 0, run = 0;
+	int fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		error_report("fork: /proc/self/pagemap: %s", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < npages; i += n) {
+		n = MIN(PM_BATCH, npages - i);
+		if (pread(fd, ent, n * sizeof(ent[0]), ((uintptr_t)rb->host / 
+						psize + i) * sizeof(ent[0])) != 
+				n * sizeof(ent[0])) {
+			error_report("fork: /proc/self/pagemap: short read");
+			close(fd);
+			return -1;
+		}
+		for (j = 0; j < n; j++) {
+			if (ent[j] & (PM_PRESENT | PM_SWAP) && 
+					!(ent[j] & PM_FILE)) {
+				if (run++ == 0)
+					start = i + j;
+				continue;
+			}
+			if (run > 0)
+				my_cow_put(f, rb->idstr, rb->host, start * psize, 
+						run * psize);
+			run = 0;
+		}
+	}
+	if (run > 0)
+		my_cow_put(f, rb->idstr, rb->host, start * psize, run * psize);
+	close(fd);
+	return 0;
+}
+
+/* the blocks other than guest ram go whole, unless they are shared anyway */
+static int my_cow_send_block(const char *name, void *host, ram_addr_t offset,
+		ram_addr_t length, void *opaque)
+{
+	RAMBlock *rb = qemu_ram_block_by_name(name);
+	if (strcmp(name, my_fork_opts.ram_id) == 0 || rb == NULL || 
+			qemu_ram_is_shared(rb))
+		return 0;
+	my_cow_put(opaque, name, host, 0, length);
+	return 0;
+}
+
+/* called with the vm stopped and the iothread lock held */
+static int my_cow_save(QEMUFile *f)
+{
+	RAMBlock *rb = qemu_ram_block_by_name(my_fork_opts.ram_id);
+	if (rb == NULL || rb->fd < 0) {
+		error_report("fork: ram=shared needs ram %s backed by a file", 
+				my_fork_opts.ram_id);
+		return -1;
+	}
+	if (!my_cow_private) {
+		/* everything we wrote so far is in the file */
+		if (qemu_ram_is_shared(rb) && my_cow_remap(rb) < 0)
+			return -1;
+		my_cow_private = true;
+	}
+	if (my_cow_send_private(f, rb) < 0)
+		return -1;
+	qemu_ram_foreach_block(my_cow_send_block, f);
+	qemu_put_byte(f, 0);
+	return qemu_save_device_state(f);
+}
+
+/*
+ * The lazy and the parallel fork send ram on sockets of their own, the
+ * channels, next to the snapshot. The snapshot starts with the list of the
+ * blocks that are not shared:
+ *
+ *	{ u8 len, idstr, be64 length } ... u8 0
+ *
+ * On a channel a block goes by its index in the list, a my_fork_hdr and the
+ * pages. The end of a channel is block FORK_END.
+ */
+#define	FORK_END	UINT32_MAX
+
+struct my_fork_hdr {
+	uint32_t	block;		/* index in the list or FORK_END */
+	uint32_t	npages;
+	uint64_t	offset;		/* in the block */
+};
+
+struct my_fork_block {
+	const char	*idstr;
+	uint8_t		*host;
+	uint64_t	length;
+};
+
+static int my_fork_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* 0 on EOF, like read */
+static int my_fork_read(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+	while (len > 0) {
+		if ((n = read(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* the list of the blocks, all but the shared ones */
+static int my_fork_add_block(const char *name, void *host, ram_addr_t offset,
+		ram_addr_t length, void *opaque)
+{
+	RAMBlock *rb = qemu_ram_block_by_name(name);
+	struct my_fork_block b = {.idstr = name, .host = host, .length = length};
+	if (rb != NULL && !qemu_ram_is_shared(rb))
+		g_array_append_val(opaque, b);
+	return 0;
+}
+
+static GArray *my_fork_blocks(void)
+{
+	GArray *blocks = g_array_new(FALSE, FALSE, sizeof(struct my_fork_block));
+	qemu_ram_foreach_block(my_fork_add_block, blocks);
+	return blocks;
+}
+
+static void my_fork_put_blocks(QEMUFile *f, GArray *blocks)
+{
+	struct my_fork_block *b = (struct my_fork_block *)blocks->data;
+	guint i;
+	for (i = 0; i < blocks->len; i++) {
+		size_t n = strlen(b[i].idstr);
+		qemu_put_byte(f, n);
+		qemu_put_buffer(f, (const uint8_t *)b[i].idstr, n);
+		qemu_put_be64(f, b[i].length);
+	}
+	qemu_put_byte(f, 0);
+}
+
+/* the list of the parent, in the child */
+static GArray *my_fork_get_blocks(QEMUFile *f)
+{
+	GArray *blocks = g_array_new(FALSE, FALSE, sizeof(struct my_fork_block));
+	struct my_fork_block b;
+	RAMBlock *rb;
+	char idstr[256];
+	int n;
+	/* a zygote sleeps here until the fork */
+	while ((n = qemu_get_byte(f)) != 0) {
+		qemu_get_buffer(f, (uint8_t *)idstr, n);
+		idstr[n] = '\0';
+		b.length = qemu_get_be64(f);
+		if (qemu_file_get_error(f))
+			break;
+		if ((rb = qemu_ram_block_by_name(idstr)) == NULL || 
+				b.length != rb->used_length) {
+			error_report("fork: bad block %s %" PRIu64, idstr, 
+					b.length);
+			exit(1);
+		}
+		b.idstr = rb->idstr;
+		b.host = rb->host;
+		g_array_append_val(blocks, b);
+	}
+	return blocks;
+}
+
+/* close our ends of the channels of a fork */
+static void my_fork_close_chans(int *chans, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		close(chans[i]);
+	g_free(chans);
+}
+
+/* the channels of a child, MY_FORK_CHANNELS=fd,fd,... */
+static int *my_fork_get_chans(int *n)
+{
+	const char *env = getenv("MY_FORK_CHANNELS");
+	char **fds;
+	int *chans;
+	*n = 0;
+	if (env == NULL)
+		return NULL;
+	fds = g_strsplit(env, ",", 0);
+	chans = g_new(int, g_strv_length(fds));
+	for (; fds[*n] != NULL; (*n)++)
+		chans[*n] = atoi(fds[*n]);
+	g_strfreev(fds);
+	return chans;
+}
+
+/*
+ * Nobody waits for the processes we fork, the child qemus run on their own
+ * and a page server exits when its child hangs up. SIGCHLD reaps them, and
+ * only them: other parts of qemu wait for their own children. A child that
+ * finds the table full stays a zombie until we exit.
+ */
+#define	MY_REAP_MAX	256
+
+static pid_t my_reap_pids[MY_REAP_MAX];
+static bool my_reap_on;
+
+static void my_reap_signal(int sig)
+{
+	int i, err = errno;
+	pid_t pid;
+	for (i = 0; i < MY_REAP_MAX; i++) {
+		pid = atomic_read(&my_reap_pids[i]);
+		if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid)
+			atomic_cmpxchg(&my_reap_pids[i], pid, 0);
+	}
+	errno = err;
+}
+
+/* reap pid when it exits */
+static void my_reap(pid_t pid)
+{
+	struct sigaction sa;
+	int i;
+	if (!atomic_xchg(&my_reap_on, true)) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = my_reap_signal;
+		sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+		sigaction(SIGCHLD, &sa, NULL);
+	}
+	for (i = 0; i < MY_REAP_MAX; i++)
+		if (atomic_cmpxchg(&my_reap_pids[i], 0, pid) == 0)
+			break;
+	/* it may have exited before it was in the table */
+	my_reap_signal(SIGCHLD);
+}
+
+/*
+ * Lazy fork, -fork-opts ram=lazy. The child starts before it has any ram and
+ * takes the pages through userfaultfd. The parent forks a copy of itself with
+ * the vm stopped, so that copy has the frozen image of guest ram, and it
+ * serves the pages on a channel while the parent runs on. The snapshot only
+ * has the list of the blocks and the device state.
+ *
+ * The server pushes every page once, in runs, and sends the pages the child
+ * faults on first. A request of the child is a my_fork_hdr too, for one
+ * page.
+ */
+#define	LAZY_RUN	64		/* pages the server pushes in one go */
+
+/* the load of a lazily forked child, its threads get it as opaque */
+struct my_lazy {
+	GArray		*blocks;	/* the list, struct my_fork_block */
+	int		pfd;		/* the channel to the page server */
+	int		uffd;		/* userfaultfd over the blocks */
+	bool		done;		/* all the pages are in */
+};
+
+static struct my_lazy *my_lazy;		/* NULL unless we were forked lazily */
+
+/*
+ * Still taking pages from our page server? Then guest ram is registered with
+ * userfaultfd and a fork() of it (our own page server) would read the pages
+ * that did not arrive as zeros, so we cannot be forked lazily yet.
+ */
+static bool my_lazy_busy(void)
+{
+	return my_lazy != NULL && !atomic_read(&my_lazy->done);
+}
+
+static int my_lazy_send(int fd, struct my_fork_block *b, 
+		struct my_fork_hdr *h, uint64_t psize)
+{
+	if (my_fork_write(fd, h, sizeof(*h)) < 0)
+		return -1;
+	return my_fork_write(fd, b[h->block].host + h->offset, 
+			h->npages * psize);
+}
+
+/*
+ * The page server, in the forked copy of the parent. Only system calls here,
+ * the other threads of qemu did not come along and may have held any lock.
+ */
+static void my_page_server(int fd, struct my_fork_block *b, int nb)
+{
+	uint64_t psize = getpagesize(), total = 0, next = 0, first = 0, i, n;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	struct my_fork_hdr h;
+	unsigned long *sent;
+	bool done = false;
+	int cur = 0;
+	for (i = 0; i < nb; i++)
+		total += b[i].length / psize;
+	sent = mmap(NULL, BITS_TO_LONGS(total + 1) * sizeof(long), 
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 
+			-1, 0);
+	if (sent == MAP_FAILED)
+		return;
+	for (;;) {
+		/* the child waits on a request, it goes first */
+		if (poll(&pfd, 1, done ? -1 : 0) > 0) {
+			if (my_fork_read(fd, &h, sizeof(h)) <= 0)
+				return;
+			if (h.block >= nb || h.offset >= b[h.block].length)
+				return;
+			h.offset &= ~(psize - 1);
+			h.npages = 1;
+			for (i = 0, n = h.offset / psize; i < h.block; i++)
+				n += b[i].length / psize;
+			set_bit(n, sent);
+			if (my_lazy_send(fd, b, &h, psize) < 0)
+				return;
+			continue;
+		}
+		if (done)
+			continue;
+		while (next < total && test_bit(next, sent))
+			next++;
+		if (next == total) {
+			h.block = FORK_END;
+			h.npages = 0;
+			h.offset = 0;
+			if (my_fork_write(fd, &h, sizeof(h)) < 0)
+				return;
+			/* serve the requests that crossed the end, until
+			 * the child hangs up */
+			done = true;
+			continue;
+		}
+		while (next >= first + b[cur].length / psize)
+			first += b[cur++].length / psize;
+		h.block = cur;
+		h.offset = (next - first) * psize;
+		for (h.npages = 0; h.npages < LAZY_RUN && next < first + 
+				b[cur].length / psize && 
+				!test_bit(next, sent); h.npages++)
+			set_bit(next++, sent);
+		if (my_lazy_send(fd, b, &h, psize) < 0)
+			return;
+	}
+}
+
+/* called with the vm stopped and the iothread lock held */
+static int my_lazy_save(QEMUFile *f)
+{
+	GArray *blocks;
+	struct my_fork_block *b;
+	pid_t pid;
+	guint i;
+	int ret = 0;
+	if (my_fork_chans == NULL)
+		return -1;
+	blocks = my_fork_blocks();
+	b = (struct my_fork_block *)blocks->data;
+	/* qemu keeps guest ram out of a fork, this one needs it */
+	for (i = 0; i < blocks->len; i++)
+		qemu_madvise(b[i].host, b[i].length, QEMU_MADV_DOFORK);
+	if ((pid = fork()) == 0) {
+		my_page_server(my_fork_chans[0], b, blocks->len);
+		_exit(0);
+	}
+	if (pid > 0)
+		my_reap(pid);
+	for (i = 0; i < blocks->len; i++)
+		qemu_madvise(b[i].host, b[i].length, QEMU_MADV_DONTFORK);
+	my_fork_close_chans(my_fork_chans, 1);
+	my_fork_chans = NULL;
+	if (pid < 0) {
+		error_report("fork: page server: %s", strerror(errno));
+		ret = -1;
+	} else {
+		my_fork_put_blocks(f, blocks);
+		ret = qemu_save_device_state(f);
+	}
+	g_array_free(blocks, TRUE);
+	return ret;
+}
+
+/*
+ * Parallel fork, ram=copy with threads=N. Ram is cut in N slices of the same
+ * size, over the blocks in a row, and a thread sends each slice on its own
+ * channel while the vm is stopped. The snapshot has the list of the blocks
+ * and the device state, the child reads the channels with N threads too.
+ */
+struct my_slice {
+	QemuThread		thread;
+	int			fd;		/* the channel */
+	struct my_fork_block	*b;
+	int			nb;
+	uint64_t		start, end;	/* bytes over all the blocks */
+	int			ret;
+};
+
+static void *my_slice_thread(void *opaque)
+{
+	struct my_slice *sl = opaque;
+	uint64_t psize = getpagesize(), pos = 0, from, to;
+	struct my_fork_hdr h;
+	int i;
+	for (i = 0; i < sl->nb; pos += sl->b[i++].length) {
+		from = MAX(sl->start, pos);
+		to = MIN(sl->end, pos + sl->b[i].length);
+		if (from >= to)
+			continue;
+		h.block = i;
+		h.npages = (to - from) / psize;
+		h.offset = from - pos;
+		if (my_fork_write(sl->fd, &h, sizeof(h)) < 0 || 
+				my_fork_write(sl->fd, sl->b[i].host + h.offset, 
+					to - from) < 0) {
+			sl->ret = -errno;
+			return NULL;
+		}
+	}
+	h.block = FORK_END;
+	h.npages = 0;
+	h.offset = 0;
+	if (my_fork_write(sl->fd, &h, sizeof(h)) < 0)
+		sl->ret = -errno;
+	return NULL;
+}
+
+/* called with the vm stopped and the iothread lock held */
+static int my_parallel_save(QEMUFile *f)
+{
+	GArray *blocks;
+	struct my_slice *sl;
+	uint64_t psize = getpagesize(), total = 0;
+	int n = my_fork_opts.threads, i, ret;
+	guint j;
+	if (my_fork_chans == NULL)
+		return -1;
+	blocks = my_fork_blocks();
+	for (j = 0; j < blocks->len; j++)
+		total += g_array_index(blocks, struct my_fork_block, j).length;
+	/* the child starts its threads once it has the list */
+	my_fork_put_blocks(f, blocks);
+	qemu_fflush(f);
+	sl = g_new0(struct my_slice, n);
+	for (i = 0; i < n; i++) {
+		sl[i].fd = my_fork_chans[i];
+		sl[i].b = (struct my_fork_block *)blocks->data;
+		sl[i].nb = blocks->len;
+		sl[i].start = QEMU_ALIGN_DOWN(total / n * i, psize);
+		sl[i].end = i == n - 1 ? total : 
+			QEMU_ALIGN_DOWN(total / n * (i + 1), psize);
+		qemu_thread_create(&sl[i].thread, "fork slice", 
+				my_slice_thread, &sl[i], QEMU_THREAD_JOINABLE);
+	}
+	ret = qemu_file_get_error(f);
+	for (i = 0; i < n; i++) {
+		qemu_thread_join(&sl[i].thread);
+		if (ret >= 0 && sl[i].ret < 0) {
+			error_report("fork: slice %d: %s", i, 
+					strerror(-sl[i].ret));
+			ret = sl[i].ret;
+		}
+	}
+	/* and the devices after the ram, like the migration stream */
+	if (ret >= 0)
+		ret = qemu_save_device_state(f);
+	my_fork_close_chans(my_fork_chans, n);
+	my_fork_chans = NULL;
+	g_free(sl);
+	g_array_free(blocks, TRUE);
+	return ret;
+}
+
+/*
+ * The snapshot of a copy-on-write, lazy or parallel fork, it takes the place
+ * of the pre-copy loop and of migration_completion
+ */
+static void my_cow_snapshot(MigrationState *s, bool *old_vm_running, 
+		int64_t *start_time)
+{
+	int ret;
+
+	qemu_mutex_lock_iothread();
+	*start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+	qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+	*old_vm_running = runstate_is_running();
+	ret = global_state_store();
+	if (!ret) {
+		ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+		if (ret >= 0 && my_fork_opts.ram == MY_FORK_RAM_SHARED)
+			ret = my_cow_save(s->to_dst_file);
+		else if (ret >= 0 && my_fork_opts.ram == MY_FORK_RAM_LAZY)
+			ret = my_lazy_save(s->to_dst_file);
+		else if (ret >= 0)
+			ret = my_parallel_save(s->to_dst_file);
+	}
+	qemu_mutex_unlock_iothread();
+	if (ret >= 0) {
+		qemu_fflush(s->to_dst_file);
+		ret = qemu_file_get_error(s->to_dst_file);
+	}
+	migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE, ret < 0 ? 
+			MIGRATION_STATUS_FAILED : MIGRATION_STATUS_COMPLETED);
+}
+
+/* the snapshot of the parent, on the socket in env */
+static QEMUFile *my_fork_fopen(const char *env)
+{
+	QIOChannelSocket *sioc;
+	QEMUFile *f;
+	Error *err = NULL;
+	sioc = qio_channel_socket_new_fd(atoi(env), &err);
+	if (sioc == NULL) {
+		error_report_err(err);
+		exit(1);
+	}
+	f = qemu_fopen_channel_input(QIO_CHANNEL(sioc));
+	object_unref(OBJECT(sioc));
+	return f;
+}
+
+/*
+ * The device state at the end of the snapshot. qemu_save_device_state() puts
+ * the file header and the sections without ram or a configuration section,
+ * so qemu_loadvm_state() would refuse it. 2.11 has no loader of its own for
+ * it, so skip the header and do what qemu_loadvm_state() does around
+ * qemu_loadvm_state_main().
+ */
+static void my_fork_load_state(QEMUFile *f)
+{
+	int ret = qemu_file_get_error(f);
+	if (ret == 0 && qemu_get_be32(f) != QEMU_VM_FILE_MAGIC) {
+		error_report("fork: not a migration stream");
+		ret = -EINVAL;
+	}
+	if (ret == 0 && qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+		error_report("fork: unsupported migration stream version");
+		ret = -ENOTSUP;
+	}
+	if (ret == 0) {
+		cpu_synchronize_all_pre_loadvm();
+		ret = qemu_loadvm_state_main(f, migration_incoming_get_current());
+		if (ret == 0)
+			ret = qemu_file_get_error(f);
+		if (ret == 0)
+			cpu_synchronize_all_post_init();
+	}
+	qemu_fclose(f);
+	if (ret < 0) {
+		error_report("fork: loading the parent failed: %s", 
+				strerror(-ret));
+		exit(1);
+	}
+}
+
+/*
+ * Child side of the copy-on-write fork, called from main before the vm
+ * starts. Our ram was mapped MAP_PRIVATE from the file (execve_argv turns
+ * share off), map it again to drop what the machine init wrote in it, then
+ * take the pages and the device state of the parent.
+ */
+static void my_fork_cow_load(void)
+{
+	const char *env = getenv("MY_FORK_FD");
+	QEMUFile *f;
+	RAMBlock *rb;
+	char idstr[256];
+	uint64_t off, len;
+	int n;
+	if (env == NULL)
+		return;
+	rb = qemu_ram_block_by_name(my_fork_opts.ram_id);
+	if (rb == NULL || rb->fd < 0 || my_cow_remap(rb) < 0) {
+		error_report("fork: no ram %s backed by a file", 
+				my_fork_opts.ram_id);
+		exit(1);
+	}
+	my_cow_private = true;
+	f = my_fork_fopen(env);
+	/* a zygote sleeps here until the fork */
+	while ((n = qemu_get_byte(f)) != 0) {
+		qemu_get_buffer(f, (uint8_t *)idstr, n);
+		idstr[n] = '\0';
+		off = qemu_get_be64(f);
+		len = qemu_get_be64(f);
+		if ((rb = qemu_ram_block_by_name(idstr)) == NULL || 
+				off + len > rb->used_length) {
+			error_report("fork: bad pages %s %" PRIu64 " %" PRIu64, 
+					idstr, off, len);
+			exit(1);
+		}
+		qemu_get_buffer(f, rb->host + off, len);
+		if (qemu_file_get_error(f))
+			break;
+	}
+	my_fork_load_state(f);
+}
+
+/*
+ * Child side of the lazy fork. A page we fault on is asked for first, the
+ * rest of the pages arrive anyway. Once all are in, userfaultfd goes away.
+ */
+static void *my_lazy_fault_thread(void *opaque)
+{
+	struct my_lazy *lz = opaque;
+	struct my_fork_block *b = (struct my_fork_block *)lz->blocks->data;
+	struct pollfd pfd = {.fd = lz->uffd, .events = POLLIN};
+	struct uffd_msg msg;
+	struct my_fork_hdr h;
+	uint64_t addr;
+	guint i;
+	while (!atomic_read(&lz->done)) {
+		/* wake up now and then to see if we are done */
+		if (poll(&pfd, 1, 100) <= 0 || read(lz->uffd, &msg, 
+					sizeof(msg)) != sizeof(msg) ||
+				msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+		addr = msg.arg.pagefault.address;
+		for (i = 0; i < lz->blocks->len; i++)
+			if (addr >= (uintptr_t)b[i].host && 
+					addr < (uintptr_t)b[i].host + 
+					b[i].length)
+				break;
+		if (i == lz->blocks->len)
+			continue;
+		h.block = i;
+		h.npages = 1;
+		h.offset = (addr - (uintptr_t)b[i].host) & ~(uint64_t)
+			(getpagesize() - 1);
+		if (my_fork_write(lz->pfd, &h, sizeof(h)) < 0)
+			break;
+	}
+	/* the server exits when we hang up */
+	close(lz->uffd);
+	close(lz->pfd);
+	return NULL;
+}
+
+/* place the pages, some may be there already from a request */
+static int my_lazy_copy(struct my_lazy *lz, uint8_t *dst, uint8_t *src, 
+		uint64_t len)
+{
+	struct uffdio_copy copy;
+	uint64_t off = 0;
+	while (off < len) {
+		copy.dst = (uintptr_t)dst + off;
+		copy.src = (uintptr_t)src + off;
+		copy.len = len - off;
+		copy.mode = 0;
+		copy.copy = 0;
+		if (ioctl(lz->uffd, UFFDIO_COPY, &copy) == 0)
+			return 0;
+		if (errno != EEXIST && errno != EAGAIN)
+			return -1;
+		if (copy.copy > 0)
+			off += copy.copy;
+		/* step over the page that is there */
+		if (errno == EEXIST)
+			off += getpagesize();
+	}
+	return 0;
+}
+
+static void *my_lazy_page_thread(void *opaque)
+{
+	struct my_lazy *lz = opaque;
+	struct my_fork_block *b = (struct my_fork_block *)lz->blocks->data;
+	uint64_t psize = getpagesize();
+	uint8_t *buf = g_malloc(LAZY_RUN * psize);
+	struct uffdio_range range;
+	struct my_fork_hdr h;
+	guint i;
+	for (;;) {
+		if (my_fork_read(lz->pfd, &h, sizeof(h)) <= 0) {
+			error_report("fork: lost the page server");
+			exit(1);
+		}
+		if (h.block == FORK_END)
+			break;
+		if (h.block >= lz->blocks->len || h.npages > LAZY_RUN ||
+				h.offset + h.npages * psize > 
+				b[h.block].length ||
+				my_fork_read(lz->pfd, buf, 
+					h.npages * psize) <= 0 ||
+				my_lazy_copy(lz, b[h.block].host + h.offset, 
+					buf, h.npages * psize) < 0) {
+			error_report("fork: bad pages of the parent: %s", 
+					strerror(errno));
+			exit(1);
+		}
+	}
+	for (i = 0; i < lz->blocks->len; i++) {
+		range.start = (uintptr_t)b[i].host;
+		range.len = b[i].length;
+		ioctl(lz->uffd, UFFDIO_UNREGISTER, &range);
+	}
+	g_free(buf);
+	/* a zygote that is this quick does not know its fork id yet */
+	if (my_fork_id != 0)
+		my_fork_stamp("paged");
+	atomic_set(&lz->done, true);
+	return NULL;
+}
+
+/* drop what the machine init wrote in our ram and fault it in from lz->pfd */
+static int my_lazy_start(struct my_lazy *lz)
+{
+	struct my_fork_block *b = (struct my_fork_block *)lz->blocks->data;
+	struct uffdio_api api = {.api = UFFD_API};
+	struct uffdio_register reg;
+	QemuThread thread;
+	guint i;
+	lz->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (lz->uffd < 0 || ioctl(lz->uffd, UFFDIO_API, &api) < 0) {
+		error_report("fork: userfaultfd: %s", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < lz->blocks->len; i++) {
+		/* userfaultfd places small pages */
+		qemu_madvise(b[i].host, b[i].length, QEMU_MADV_NOHUGEPAGE);
+		qemu_madvise(b[i].host, b[i].length, QEMU_MADV_DONTNEED);
+		reg.range.start = (uintptr_t)b[i].host;
+		reg.range.len = b[i].length;
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+		if (ioctl(lz->uffd, UFFDIO_REGISTER, &reg) < 0) {
+			error_report("fork: userfaultfd on %s: %s", 
+					b[i].idstr, strerror(errno));
+			return -1;
+		}
+	}
+	qemu_thread_create(&thread, "fork faults", my_lazy_fault_thread, 
+			lz, QEMU_THREAD_DETACHED);
+	qemu_thread_create(&thread, "fork pages", my_lazy_page_thread, 
+			lz, QEMU_THREAD_DETACHED);
+	return 0;
+}
+
+/*
+ * Called from main before the vm starts. The device state is loaded while
+ * the pages still come in, a device that looks at guest ram faults like the
+ * vcpus do.
+ */
+static void my_fork_lazy_load(void)
+{
+	const char *env = getenv("MY_FORK_FD");
+	QEMUFile *f;
+	int *chans, n;
+	if (env == NULL || (chans = my_fork_get_chans(&n)) == NULL)
+		return;
+	f = my_fork_fopen(env);
+	my_lazy = g_new0(struct my_lazy, 1);
+	my_lazy->blocks = my_fork_get_blocks(f);
+	my_lazy->pfd = chans[0];
+	if (qemu_file_get_error(f) == 0 && my_lazy_start(my_lazy) < 0)
+		exit(1);
+	g_free(chans);
+	my_fork_load_state(f);
+}
+
+/* a channel of the parallel fork, in the child */
+struct my_chan_load {
+	QemuThread		thread;
+	int			fd;
+	GArray			*blocks;
+	int			ret;
+};
+
+static void *my_chan_load_thread(void *opaque)
+{
+	struct my_chan_load *c = opaque;
+	struct my_fork_block *b = (struct my_fork_block *)c->blocks->data;
+	uint64_t psize = getpagesize();
+	struct my_fork_hdr h;
+	for (;;) {
+		if (my_fork_read(c->fd, &h, sizeof(h)) <= 0) {
+			c->ret = -EIO;
+			break;
+		}
+		if (h.block == FORK_END)
+			break;
+		if (h.block >= c->blocks->len || h.offset + h.npages * psize > 
+				b[h.block].length || my_fork_read(c->fd, 
+					b[h.block].host + h.offset, 
+					h.npages * psize) <= 0) {
+			c->ret = -EINVAL;
+			break;
+		}
+	}
+	close(c->fd);
+	return NULL;
+}
+
+/* called from main before the vm starts, ram first, then the devices */
+static void my_fork_parallel_load(void)
+{
+	const char *env = getenv("MY_FORK_FD");
+	struct my_chan_load *c;
+	GArray *blocks;
+	QEMUFile *f;
+	int *chans, n, i, ret = 0;
+	if (env == NULL || (chans = my_fork_get_chans(&n)) == NULL)
+		return;
+	f = my_fork_fopen(env);
+	blocks = my_fork_get_blocks(f);
+	c = g_new0(struct my_chan_load, n);
+	for (i = 0; i < n; i++) {
+		c[i].fd = chans[i];
+		c[i].blocks = blocks;
+		qemu_thread_create(&c[i].thread, "fork slice", 
+				my_chan_load_thread, &c[i], 
+				QEMU_THREAD_JOINABLE);
+	}
+	for (i = 0; i < n; i++) {
+		qemu_thread_join(&c[i].thread);
+		if (c[i].ret < 0)
+			ret = c[i].ret;
+	}
+	if (ret < 0) {
+		error_report("fork: loading the ram of the parent failed: %s",
+				strerror(-ret));
+		exit(1);
+	}
+	g_free(c);
+	g_free(chans);
+	g_array_free(blocks, TRUE);
+	my_fork_load_state(f);
+}
+
 /*
  * the difference between original code is that this function makes vm to 
  * run after migration is completed
@@ -2097,9 +3055,18 @@ static void *my_migration_thread(void *opaque)
     /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
     enum MigrationStatus current_active_state = MIGRATION_STATUS_ACTIVE;
     bool enable_colo = migrate_colo_enabled();
+    bool cow = my_fork_own_snapshot();
 
     rcu_register_thread();
 
+    if (cow) {
+        /* no ram to iterate over, just the snapshot */
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_ACTIVE);
+        my_cow_snapshot(s, &old_vm_running, &start_time);
+        goto done;
+    }
+
     qemu_savevm_state_header(s->to_dst_file);
 
     qemu_savevm_state_setup(s->to_dst_file);
@@ -2110,6 +3077,14 @@ static void *my_migration_thread(void *opaque)
 
     //trace_migration_thread_setup_complete();
 
+    if (!my_fork_opts.live) {
+        /* stop-and-copy: setup left every page dirty, the completion stops
+         * the vcpus once and sends all of them in one pass */
+        migration_completion(s, current_active_state,
+                             &old_vm_running, &start_time);
+        goto done;
+    }
+
     while (s->state == MIGRATION_STATUS_ACTIVE ||
            s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
@@ -2148,7 +3123,7 @@ static void *my_migration_thread(void *opaque)
                                          initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = (double)transferred_bytes / time_spent;
-            threshold_size = bandwidth * s->parameters.downtime_limit;
+            threshold_size = bandwidth * my_fork_opts.downtime;
 
             s->mbps = (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -2172,6 +3147,7 @@ static void *my_migration_thread(void *opaque)
         }
     }
 
+done:
     //trace_migration_thread_after_loop();
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
@@ -2182,7 +3158,7 @@ static void *my_migration_thread(void *opaque)
      * The resource has been allocated by migration will be reused in COLO
      * process, so don't release them.
      */
-    if (!enable_colo) {
+    if (!enable_colo && !cow) {
         qemu_savevm_state_cleanup();
     }
     if (s->state == MIGRATION_STATUS_COMPLETED) {
@@ -2214,6 +3190,7 @@ static void *my_migration_thread(void *opaque)
             }
         }
     }
+    my_fork_release(s->state == MIGRATION_STATUS_COMPLETED);
     Error *err = NULL;
     qmp_cont(&err);
     qemu_bh_schedule(s->cleanup_bh);
@@ -2229,12 +3206,15 @@ static void *my_migration_thread(void *opaque)
  * */
 void my_migrate_fd_connect(MigrationState *s)
 {
-    s->expected_downtime = s->parameters.downtime_limit;
+    s->expected_downtime = my_fork_opts.downtime;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
     qemu_file_set_blocking(s->to_dst_file, true);
-    qemu_file_set_rate_limit(s->to_dst_file,
-                             s->parameters.max_bandwidth / XFER_LIMIT_RATIO);
+    /* a fork is memory to memory, it is not throttled like a migration
+     * unless -fork-opts bandwidth asks for it */
+    qemu_file_set_rate_limit(s->to_dst_file, my_fork_opts.bandwidth == 0 ?
+                             INT64_MAX :
+                             my_fork_opts.bandwidth / XFER_LIMIT_RATIO);
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
@@ -2268,109 +3248,201 @@ void my_migration_channel_connect(MigrationState *s,
     my_migrate_fd_connect(s);
 }
 
-/* copied from exec.c it calls my_migration_channel_connect instead of the 
- * original migration_channel_connect
+/*
+ * Host side of the fork timing. With MY_FORK_LOG=file in the environment
+ * every stage appends "id stage ns" to the file, ns of CLOCK_MONOTONIC so
+ * that the lines of the parent and of the child qemu can be compared. The id
+ * comes from the guest, see kern.my_fork.times.
  */
-void my_exec_start_outgoing_migration(MigrationState *s, const char *command, Error **errp)
+static int64_t my_fork_now(void)
 {
-    QIOChannel *ioc;
-    const char *argv[] = { "/bin/sh", "-c", command, NULL };
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    //trace_migration_exec_outgoing(command);
-    ioc = QIO_CHANNEL(qio_channel_command_new_spawn(argv,
-                                                    O_RDWR,
-                                                    errp));
-    if (!ioc) {
-        return;
-    }
+static void my_fork_stamp_at(const char *stage, int64_t ns)
+{
+	char line[64];
+	const char *path;
+	int n;
+	if (my_fork_log == -2) {
+		path = getenv("MY_FORK_LOG");
+		my_fork_log = path == NULL ? -1 : open(path, 
+				O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 
+				S_IRUSR | S_IWUSR);
+	}
+	if (my_fork_log < 0)
+		return;
+	n = snprintf(line, sizeof(line), "%u %s %lld\n", my_fork_id, stage,
+			(long long)ns);
+	/* one write per line, so parent and child do not mix them up */
+	if (write(my_fork_log, line, n) != n)
+		perror("MY_FORK_LOG");
+}
 
-    qio_channel_set_name(ioc, "my-migration-exec-outgoing");
-    my_migration_channel_connect(s, ioc, NULL);
-    object_unref(OBJECT(ioc));
+void my_fork_stamp(const char *stage)
+{
+	my_fork_stamp_at(stage, my_fork_now());
 }
 
-/* start migration using exec migration */
-void my_start_migration(void *data)
+/* called first thing in main, a child qemu finds its fork id in MY_FORK_ID */
+void my_fork_exec_stamp(void)
 {
-	uint8_t *ptr = data;
-	int p = 0;
-	/* return 0 to the guest vm */
-	stl_p(ptr,p);
-	const char uri[] = "exec:cat > /tmp/vm_migration.out", *pa;
-	Error *errp = NULL;
-	MigrationState *s;
-	s = migrate_init();
-	strstart(uri, "exec:", &pa);
-	my_exec_start_outgoing_migration(s, pa, &errp);
+	const char *id = getenv("MY_FORK_ID");
+	if (id == NULL)
+		return;
+	my_fork_id = strtoul(id, NULL, 10);
+	my_fork_stamp("exec");
 }
 
-/* 
- * a helper function that copies argv to a new array and adds -incoming option
- */
-extern char **my_argv;
-extern int my_argc;
-char **execve_argv(void)
+/* the guest tells us the id of the fork it is starting, or in a child the
+ * id of the fork that made it */
+static void set_fork_id(void *data)
 {
-	// allocate memory and copy strings
-	int i;
-	char** new_argv = g_malloc((my_argc + 3) * sizeof(*new_argv));
-    	for(i = 0; i < my_argc; i++)
-    	    	new_argv[i] = g_strdup(my_argv[i]);
-    	new_argv[my_argc] = g_strdup("-incoming");
-    	new_argv[my_argc + 1] = g_strdup("exec: cat /tmp/vm_migration.out");
-    	new_argv[my_argc + 2] = NULL;
-	return new_argv;
+	my_fork_id = ldl_p(data);
+	/* the first thing a child does when it runs, so it is loaded. A
+	 * zygote only learns its fork id here. */
+	if (my_fork_child) {
+		my_fork_child = false;
+		my_fork_stamp("loaded");
+	}
 }
 
-/* check_migration hypercall from guest, checks if migration has been 
- * completed 
- * */
-void check_migration(void *data)
-{
-	uint8_t *ptr = data;
-	/* check if migration is completed
-	 * While migration is not completed return 0 to vm
-	 * If migration is completed then check how many times has the guest
-	 * issued this hypercall. 
-	 * If it is just once then it is the child 
-	 * so return 2 to notify vm that it is the child 
-	 * If it is more than once then return 1 to the vm, so the vm knows 
-	 * that it is the parent and will re issue the hypercall to fork*/
-	MigrationState *s = migrate_get_current();
-	if(s->migration_thread_running == true) {
-		my_cnt++;
-		stl_p(ptr,0);
-		return;
+/*
+ * -fork-opts zygotes=N,ram=copy|shared|lazy,ram-id=ID,snapshot=stop|live,
+ * bandwidth=SIZE,downtime=MS,buffer=SIZE,threads=N, vl.c takes it out of argv
+ * before qemu parses it. They are for the snapshots of fork only, the
+ * parameters of migration stay as they are.
+ */
+void my_fork_set_opts(const char *str)
+{
+	char **kv = g_strsplit(str, ",", 0), **p, *val;
+	for (p = kv; *p != NULL; p++) {
+		if ((val = strchr(*p, '=')) == NULL) {
+			error_report("-fork-opts: %s needs a value", *p);
+			exit(1);
+		}
+		*val++ = '\0';
+		if (strcmp(*p, "zygotes") == 0) {
+			if (qemu_strtoi(val, NULL, 10, &my_fork_opts.zygotes) < 0 
+					|| my_fork_opts.zygotes < 0) {
+				error_report("-fork-opts: bad zygotes %s", val);
+				exit(1);
+			}
+		} else if (strcmp(*p, "ram") == 0) {
+			if (strcmp(val, "copy") == 0)
+				my_fork_opts.ram = MY_FORK_RAM_COPY;
+			else if (strcmp(val, "shared") == 0)
+				my_fork_opts.ram = MY_FORK_RAM_SHARED;
+			else if (strcmp(val, "lazy") == 0)
+				my_fork_opts.ram = MY_FORK_RAM_LAZY;
+			else {
+				error_report("-fork-opts: ram is copy, shared "
+						"or lazy");
+				exit(1);
+			}
+		} else if (strcmp(*p, "snapshot") == 0) {
+			if (strcmp(val, "stop") == 0)
+				my_fork_opts.live = false;
+			else if (strcmp(val, "live") == 0)
+				my_fork_opts.live = true;
+			else {
+				error_report("-fork-opts: snapshot is stop or "
+						"live");
+				exit(1);
+			}
+		} else if (strcmp(*p, "bandwidth") == 0) {
+			if (qemu_strtosz(val, NULL, &my_fork_opts.bandwidth) 
+					< 0) {
+				error_report("-fork-opts: bad bandwidth %s", 
+						val);
+				exit(1);
+			}
+		} else if (strcmp(*p, "downtime") == 0) {
+			if (qemu_strtou64(val, NULL, 10, 
+						&my_fork_opts.downtime) < 0) {
+				error_report("-fork-opts: bad downtime %s", val);
+				exit(1);
+			}
+		} else if (strcmp(*p, "buffer") == 0) {
+			if (qemu_strtosz(val, NULL, &my_fork_opts.buffer) < 0 ||
+					my_fork_opts.buffer > INT_MAX) {
+				error_report("-fork-opts: bad buffer %s", val);
+				exit(1);
+			}
+		} else if (strcmp(*p, "threads") == 0) {
+			if (qemu_strtoi(val, NULL, 10, &my_fork_opts.threads) < 0 
+					|| my_fork_opts.threads < 0 || 
+					my_fork_opts.threads > 
+					MY_FORK_MAX_THREADS) {
+				error_report("-fork-opts: bad threads %s", val);
+				exit(1);
+			}
+		} else if (strcmp(*p, "ram-id") == 0) {
+			g_free(my_fork_opts.ram_id);
+			my_fork_opts.ram_id = g_strdup(val);
+		} else {
+			error_report("-fork-opts: unknown option %s", *p);
+			exit(1);
+		}
 	}
-	if(my_cnt > 0) 
-		stl_p(ptr,1);
-	else 
-		stl_p(ptr,2);
-	return;
+	g_strfreev(kv);
 }
 
-/* fork hypercall from guest, 
- * spawns a new vm that uses the migration file that have been generated
- * */
-void my_fork(void *data)
+/*
+ * Spawn the qemu of the child, it waits for the migration on fd. The parent
+ * keeps streaming the state of the vm into the other end of the socketpair,
+ * while the child starts up.
+ */
+static pid_t spawn_child(int fd, int *chans, int nchans, bool zygote)
 {
-	uint8_t *ptr = data;
 	pid_t p = 0;
 
+	if (!zygote)
+		my_fork_stamp("fork");
 	p = fork();
 	if (p == 0) {
 		/* child */
-		char *envp[] = {NULL};
+		char *envp[] = {g_strdup("MY_FORK_CHILD=1"), NULL, NULL, NULL, 
+			NULL, NULL};
 		char **argv1;
+		GString *list;
+		int n = 1, i;
+		/* the socketpairs are close-on-exec, so that the other
+		 * children do not get them, but this one needs its ends */
+		fcntl(fd, F_SETFD, 0);
+		for (i = 0; i < nchans; i++)
+			fcntl(chans[i], F_SETFD, 0);
+		/* pass the fork timing on to the child qemu, a zygote does not
+		 * know its fork yet */
+		if (getenv("MY_FORK_LOG") != NULL) {
+			envp[n++] = g_strdup_printf("MY_FORK_LOG=%s", 
+					getenv("MY_FORK_LOG"));
+			if (!zygote)
+				envp[n++] = g_strdup_printf("MY_FORK_ID=%u", 
+						my_fork_id);
+		}
+		/* a child without -incoming reads the parent in
+		 * my_fork_init */
+		if (my_fork_own_snapshot())
+			envp[n++] = g_strdup_printf("MY_FORK_FD=%d", fd);
+		if (nchans > 0) {
+			list = g_string_new("MY_FORK_CHANNELS=");
+			for (i = 0; i < nchans; i++)
+				g_string_append_printf(list, i ? ",%d" : "%d", 
+						chans[i]);
+			envp[n++] = g_string_free(list, FALSE);
+		}
 		/* redirect output of child in a special file 
 		 * therefore child and parent will not fight over stdout */
-		int fd = open("/tmp/my_server.out", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		int out = open("/tmp/my_server.out", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
 		/* make stdout go to file */
-		dup2(fd, 1);   
+		dup2(out, 1);   
 		/* make stderr go to file */
-		dup2(fd, 2);  
-		close(fd);
-		argv1 = execve_argv();
+		dup2(out, 2);  
+		close(out);
+		argv1 = execve_argv(fd);
 		execve(argv1[0], argv1, envp);
 		/* control should not reach this code */
 		perror("execve");
@@ -2378,13 +3450,285 @@ void my_fork(void *data)
 	} else if (p == -1) {
 		/* error */
 		perror("fork");
-		exit(1);
 	} else {
-		/* parent */
-		/* return thee process id of new qemu instance */
-		stl_p(ptr,p);
+		my_reap(p);
+	}
+	return p;
+}
+
+/* -fork-opts buffer, for both ends of a socketpair */
+static void set_buffers(int sv[2])
+{
+	int size = my_fork_opts.buffer, i;
+	if (size == 0 || sv[0] < 0)
+		return;
+	for (i = 0; i < 2; i++)
+		if (setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &size, 
+					sizeof(size)) < 0 || 
+				setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &size,
+					sizeof(size)) < 0)
+			perror("fork: socket buffer");
+}
+
+/*
+ * Spawn a child qemu that waits on a new socketpair and return our end, -1
+ * if we cannot. A lazy or parallel child gets the channels too, our ends go
+ * in chans.
+ */
+static int new_child(pid_t *pid, bool zygote, int **chans)
+{
+	int sv[2], n = my_fork_nchans(), i, made = 0;
+	int *ours = n > 0 ? g_new(int, n) : NULL, *theirs = g_new(int, n + 1);
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		goto fail;
+	}
+	set_buffers(sv);
+	for (made = 0; made < n; made++) {
+		int cv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, cv) < 0) {
+			perror("socketpair");
+			break;
+		}
+		set_buffers(cv);
+		ours[made] = cv[0];
+		theirs[made] = cv[1];
+	}
+	if (made == n)
+		*pid = spawn_child(sv[1], theirs, n, zygote);
+	close(sv[1]);
+	for (i = 0; i < made; i++)
+		close(theirs[i]);
+	g_free(theirs);
+	if (made < n || *pid < 0) {
+		close(sv[0]);
+		my_fork_close_chans(ours, made);
+		return -1;
+	}
+	*chans = ours;
+	return sv[0];
+fail:
+	g_free(ours);
+	g_free(theirs);
+	return -1;
+}
+
+/* take a zygote out of the pool, -1 if it is empty */
+static int take_zygote(pid_t *pid, int **chans)
+{
+	int fd = -1;
+	if (my_fork_opts.zygotes == 0)
+		return -1;
+	qemu_mutex_lock(&my_zygote_lock);
+	if (my_nzygotes > 0) {
+		my_nzygotes--;
+		*pid = my_zygotes[my_nzygotes].pid;
+		*chans = my_zygotes[my_nzygotes].chans;
+		fd = my_zygotes[my_nzygotes].fd;
+	}
+	qemu_mutex_unlock(&my_zygote_lock);
+	return fd;
+}
+
+/*
+ * Bottom half that spawns zygotes until the pool is full. It runs in the
+ * main loop, off the path of the fork.
+ */
+static void fill_pool(void *opaque)
+{
+	struct my_zygote z;
+	for (;;) {
+		qemu_mutex_lock(&my_zygote_lock);
+		if (my_nzygotes >= my_fork_opts.zygotes) {
+			qemu_mutex_unlock(&my_zygote_lock);
+			return;
+		}
+		qemu_mutex_unlock(&my_zygote_lock);
+		/* the next fork makes its own child */
+		if ((z.fd = new_child(&z.pid, true, &z.chans)) < 0)
+			return;
+		qemu_mutex_lock(&my_zygote_lock);
+		my_zygotes[my_nzygotes++] = z;
+		qemu_mutex_unlock(&my_zygote_lock);
+	}
+}
+
+/* 
+ * Fill the pool whenever the vm (re)starts: at boot, after every fork in the
+ * parent and after the load in a child. A zygote never runs while it waits,
+ * so zygotes do not make zygotes of their own.
+ */
+static void pool_vm_state(void *opaque, int running, RunState state)
+{
+	if (running)
+		qemu_bh_schedule(my_zygote_bh);
+}
+
+static void my_fork_pool_init(void)
+{
+	if (my_fork_opts.zygotes == 0)
+		return;
+	qemu_mutex_init(&my_zygote_lock);
+	my_zygotes = g_new0(struct my_zygote, my_fork_opts.zygotes);
+	my_zygote_bh = qemu_bh_new(fill_pool, NULL);
+	qemu_add_vm_change_state_handler(pool_vm_state, NULL);
+}
+
+/* called by vl.c once the machine is set up, before it starts */
+void my_fork_init(void)
+{
+	if (my_fork_opts.ram_id == NULL)
+		my_fork_opts.ram_id = g_strdup("pc.ram");
+	if (my_fork_opts.threads == 0)
+		my_fork_opts.threads = MIN(sysconf(_SC_NPROCESSORS_ONLN), 
+				MY_FORK_MAX_THREADS);
+	/* the first fork hypercall of a child is the one of its parent */
+	my_fork_child = getenv("MY_FORK_CHILD") != NULL;
+	if (my_fork_opts.ram == MY_FORK_RAM_SHARED)
+		my_fork_cow_load();
+	else if (my_fork_opts.ram == MY_FORK_RAM_LAZY)
+		my_fork_lazy_load();
+	else if (my_fork_parallel())
+		my_fork_parallel_load();
+	my_fork_pool_init();
+}
+
+/* the migration goes straight into the child, a zygote of the pool if there
+ * is one */
+static int my_start_migration(void)
+{
+	int fd;
+	QIOChannelSocket *sioc;
+	Error *errp = NULL;
+	MigrationState *s;
+	if ((fd = take_zygote(&my_child_pid, &my_fork_chans)) < 0 &&
+			(fd = new_child(&my_child_pid, false,
+					&my_fork_chans)) < 0)
+		return -1;
+	sioc = qio_channel_socket_new_fd(fd, &errp);
+	if (sioc == NULL) {
+		error_report_err(errp);
+		close(fd);
+		my_fork_close_chans(my_fork_chans, my_fork_nchans());
+		my_fork_chans = NULL;
+		return -1;
+	}
+	qio_channel_set_name(QIO_CHANNEL(sioc), "my-migration-fork-outgoing");
+	s = migrate_init();
+	my_migration_channel_connect(s, QIO_CHANNEL(sioc), NULL);
+	object_unref(OBJECT(sioc));
+	return 0;
+}
+
+/*
+ * The -object of guest ram with share turned off, so that the machine init
+ * of a copy-on-write child does not write in the image of the parent
+ */
+static char *private_ram_object(const char *arg)
+{
+	char **kv = g_strsplit(arg, ",", 0), **p, *id, *ret;
+	bool ram = false;
+	id = g_strdup_printf("id=%s", my_fork_opts.ram_id);
+	for (p = kv; *p != NULL; p++)
+		if (strcmp(*p, id) == 0)
+			ram = true;
+	if (ram) {
+		for (p = kv; *p != NULL; p++) {
+			if (strcmp(*p, "share") == 0 || 
+					strncmp(*p, "share=", 6) == 0) {
+				g_free(*p);
+				*p = g_strdup("share=off");
+			}
+		}
+	}
+	ret = g_strjoinv(",", kv);
+	g_strfreev(kv);
+	g_free(id);
+	return ret;
+}
+
+/* 
+ * a helper function that copies argv to a new array and adds -incoming option
+ * for fd. The -incoming of our own command line, if we are a child too, is
+ * left out. A child that loads our own snapshot gets fd in MY_FORK_FD
+ * instead.
+ */
+extern char **my_argv;
+extern int my_argc;
+char **execve_argv(int fd)
+{
+	// allocate memory and copy strings
+	int i, n = 0;
+	char** new_argv = g_malloc((my_argc + 3) * sizeof(*new_argv));
+    	for(i = 0; i < my_argc; i++) {
+		if (strcmp(my_argv[i], "-incoming") == 0 && i + 1 < my_argc) {
+			i++;
+			continue;
+		}
+		if (my_fork_opts.ram == MY_FORK_RAM_SHARED && i > 0 && 
+				strcmp(my_argv[i - 1], "-object") == 0) {
+			new_argv[n++] = private_ram_object(my_argv[i]);
+			continue;
+		}
+    	    	new_argv[n++] = g_strdup(my_argv[i]);
+	}
+	if (!my_fork_own_snapshot()) {
+    		new_argv[n++] = g_strdup("-incoming");
+    		new_argv[n++] = g_strdup_printf("fd:%d", fd);
+	}
+    	new_argv[n] = NULL;
+	return new_argv;
+}
+
+/*
+ * Fork hypercall from the guest. The IN returns 0, that is what the child
+ * finds in the snapshot. KVM completes the IN when the vcpu goes back in
+ * KVM_RUN, and it leaves again at once and waits stopped until the snapshot
+ * is over and the child qemu is up. Then my_fork_release puts the pid of the
+ * child in eax of the parent. The child resumes after the IN with that 0 and
+ * does not run the hypercall again.
+ */
+void my_fork(CPUState *cpu, void *data)
+{
+	if (my_fork_cpu != NULL || (my_fork_opts.ram == MY_FORK_RAM_LAZY && 
+				my_lazy_busy())) {
+		/* another vcpu is forking, or our own pages still come in */
+		stl_p(data, -1);
 		return;
 	}
+	my_fork_stamp("start");
+	stl_p(data, 0);
+	my_fork_cpu = cpu;
+	cpu_stop_current();
+	if (my_start_migration() < 0) {
+		/* no snapshot and no child, we are still in the vcpu thread
+		 * so the vcpu just goes on and the IN fails */
+		my_fork_cpu = NULL;
+		cpu->stop = false;
+		stl_p(data, -1);
+	}
+}
+
+/*
+ * End of the snapshot, called with the iothread lock held. The parked vcpu
+ * gets the pid of the child, or -1, and runs as soon as the vm does.
+ */
+static void my_fork_release(bool ok)
+{
+	CPUState *cpu = my_fork_cpu;
+	if (cpu == NULL)
+		return;
+	if (ok)
+		my_fork_stamp("migrated");
+	/* the IN is over, the result goes in the registers, the vcpu is dirty
+	 * from now on and gets them back before it runs */
+	kvm_cpu_synchronize_state(cpu);
+#ifdef TARGET_I386
+	X86_CPU(cpu)->env.regs[R_EAX] = ok ? (uint32_t)my_child_pid : 
+		(uint32_t)-1;
+#endif
+	my_fork_cpu = NULL;
+	cpu_resume(cpu);
 }
 
 int kvm_cpu_exec(CPUState *cpu)
@@ -2465,23 +3809,16 @@ int kvm_cpu_exec(CPUState *cpu)
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
-	    /* check the status of migration thread */
-	    if (run->io.port == 0xffdb && run->io.direction == KVM_EXIT_IO_IN ) {
-		    check_migration((uint8_t *)run + run->io.data_offset);
+	    /* id of the next fork, for the timing */
+	    if (run->io.port == 0xffda && run->io.direction == KVM_EXIT_IO_OUT ) {
+		    set_fork_id((uint8_t *)run + run->io.data_offset);
 		    ret = 0;
 		    break;
 	    }
-	    /* fork hypercall */
+	    /* fork hypercall, the vcpu stays in qemu until the snapshot is
+	     * taken */
 	    if (run->io.port == 0xffdc && run->io.direction == KVM_EXIT_IO_IN ) {
-		    my_fork((uint8_t *)run + run->io.data_offset);
-		    ret = 0;
-		    break;
-	    }
-	    /* start migration hypercall */
-	    if (run->io.port == 0xffdd && run->io.direction == KVM_EXIT_IO_IN ) {
-	//    if (run->io.port == 0xffdc && *(uint8_t *)((char *) (run) + 
-	//			    run->io.data_offset) == 77) {
-		    my_start_migration((uint8_t *)run + run->io.data_offset);
+		    my_fork(cpu, (uint8_t *)run + run->io.data_offset);
 		    ret = 0;
 		    break;
 	    }
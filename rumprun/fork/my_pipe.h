@@ -1,43 +1,158 @@
+#include <sys/ioccom.h>
+#include <sys/uio.h>
+
+#include "my_pipe_shm.h"
+
+/*
+ * Argument of MY_PIPE_READV, every iovec gets one record and its iov_len
+ * is set to the number of bytes that were stored
+ */
+struct my_pipe_readv {
+	struct iovec	*iov;		/* one record per iovec */
+	int		iovcnt;		/* number of iovecs */
+	int		nrec;		/* records read */
+};
+
+/*
+ * Argument of the MY_PIPE_B* ioctls. Rumprun runs the application in the
+ * address space of the kernel, so addr can be used as it is.
+ */
+struct my_pipe_buf {
+	void		*addr;		/* start of the buffer */
+	uint32_t	off;		/* offset in the shared memory */
+	uint32_t	len;		/* size of the buffer */
+};
+
+/*
+ * ioctls for my_pipe descriptors, userspace can include this header to get
+ * them
+ */
+/* iterations a pipe spins before it sleeps, -1 follows kern.my_pipe.spin_max */
+#define	MY_PIPE_SETSPIN		_IOW('f', 140, int)
+#define	MY_PIPE_GETSPIN		_IOR('f', 141, int)
+/* size of the pipe buffer, SETSZ rounds it up and returns the new size */
+#define	MY_PIPE_SETSZ		_IOWR('f', 142, int)
+#define	MY_PIPE_GETSZ		_IOR('f', 143, int)
+/* where the ring of the pipe is, see my_pipe_ring.h */
+#define	MY_PIPE_MAP		_IOR('f', 144, struct my_pipe_map)
+/* sleep until the ring has that many bytes (read end) or free bytes
+ * (write end), or until the other side leaves */
+#define	MY_PIPE_WAIT		_IOW('f', 145, int)
+/* wake up whoever sleeps on the other side of the ring */
+#define	MY_PIPE_WAKE		_IO('f', 146)
+/* packet mode on (1) or off (0), it can only change while the pipe is
+ * empty. my_pipe2(fildes, O_DIRECT) creates a pipe in packet mode. */
+#define	MY_PIPE_SETPKT		_IOW('f', 147, int)
+#define	MY_PIPE_GETPKT		_IOR('f', 148, int)
+/* read up to iovcnt records in one go, packet mode only */
+#define	MY_PIPE_READV		_IOWR('f', 149, struct my_pipe_readv)
+/* zero-copy buffers, packet mode only: allocate len bytes of shared memory,
+ * pass off and len (at most what was allocated) to the read end, take the
+ * next buffer out of the pipe (len is 0 at EOF) and give a buffer back. Only
+ * buffers of BALLOC can be sent or freed, EINVAL for anything else. read(2)
+ * and READV stop at a buffer with ENOMSG and leave it for BRECV. In packet
+ * mode FIONREAD is the length of the next record. */
+#define	MY_PIPE_BALLOC		_IOWR('f', 150, struct my_pipe_buf)
+#define	MY_PIPE_BSEND		_IOW('f', 151, struct my_pipe_buf)
+#define	MY_PIPE_BRECV		_IOR('f', 152, struct my_pipe_buf)
+#define	MY_PIPE_BFREE		_IOW('f', 153, struct my_pipe_buf)
+
+/*
+ * Stages of the last my_fork in ns, sysctl kern.my_fork.times. qemu gets the
+ * id of every fork too and logs its own stages under it, see MY_FORK_LOG in
+ * kvm-all.c.
+ */
+struct my_fork_times {
+	uint32_t	id;		/* fork number in this unikernel */
+	uint32_t	child;		/* 1 if we are the child */
+	int64_t		hypercall;	/* fork hypercall, until qemu has the
+					   snapshot and the child is up */
+	int64_t		handshake;	/* until the child shows up in the
+					   shared memory */
+	int64_t		total;		/* the whole system call */
+};
+
+#ifdef _KERNEL
 #include <sys/bus.h>
+#include <sys/mutex.h>
+#include <sys/condvar.h>
+#include <sys/select.h>
+#include <sys/queue.h>
 
-#define	MY_PIPE_BUF_SIZE	1024
+#define	MY_PIPE_SPIN_MAX	2000		/* default kern.my_pipe.spin_max */
+#define	MY_PIPE_SPIN_MIN	16		/* we always spin at least that
+						   much before sleeping */
 
+#define	MY_PIPE_BUF_SIZE	1024		/* smallest pipe buffer, must
+						   be a power of 2 */
+
+/* ivshmem registers in BAR0 */
+#define	IVSHMEM_INTRMASK	0x00		/* interrupt mask */
+#define	IVSHMEM_INTRSTATUS	0x04		/* interrupt status */
+#define	IVSHMEM_IVPOSITION	0x08		/* our peer id */
+#define	IVSHMEM_DOORBELL	0x0c		/* ring a peer */
+
+/*
+ * A pipe of the current process
+ */
 struct my_pipe {
-	bus_size_t	init;		/* is shared memory initalized? */
-	bus_size_t	lock;		/* pipe lock */
-	bus_size_t	wr_lock;	/* writers lock */
-	bus_size_t	nreaders;	/* number of readers in pipe */
-	bus_size_t	nwriters;	/* number of writers in pipe */
-	bus_size_t	len;		/* size of pipe buffer */
-	bus_size_t	in;		/* pointer for next write */
-	bus_size_t	out;		/* pointer for next read */
-	bus_size_t	cnt;		/* number of bytes in pipe */
-	bus_size_t	buf;		/* pipe buffer */
-	int		pr_readers;	/* readers from this process */
-	int		pr_writers;	/* writers from curr process */
+	struct my_pipe_ctl	*ctl;		/* control block */
+	bus_size_t		ctl_off;	/* offset of control block */
+	int			slot;		/* slot in directory */
+	int			pr_readers;	/* readers from this process */
+	int			pr_writers;	/* writers from curr process */
+	int			spin_max;	/* spin budget, -1 for the
+						   global one */
+	struct selinfo		sel[2];		/* pollers of the read and
+						   the write end */
+	uint32_t		*sel_waiter[2];	/* waiter slot we keep while
+						   there are pollers */
+	int			sel_poll[2];	/* pollers without a waiter
+						   slot, they are woken
+						   every tick */
+	int			sel_ticks[2];	/* hardclock_ticks of the
+						   last poll */
+	LIST_ENTRY(my_pipe)	list;		/* pipes of this kernel */
 };
 
 struct my_pipe_op {
 	int		oper;		/* operation in pipe 0 for read, 
 					   1 for write*/
+	int		spin;		/* how long the recent waits spun */
 	struct my_pipe	*pipe;
 };
 
 struct ivshm {
 	bus_size_t		data_s;		/* size of shared memory */
-	bus_addr_t		data_b;		/* base address of shared
+	uint8_t			*data_b;	/* kernel address of shared
 						   memory */
 	bus_space_tag_t		data_t;		/* bus tag for shared memory */
 	bus_space_handle_t	data_h;		/* bus handle for shared 
 						   memory */
+	bus_space_tag_t		reg_t;		/* bus tag for registers */
+	bus_space_handle_t	reg_h;		/* bus handle for registers */
+	bus_size_t		pipe_size;	/* default size of pipe
+							   buffers */
+	int			peer;		/* our ivshmem peer id, -1 if
+						   there are no doorbells */
+	kmutex_t		intr_lock;	/* lock for intr_cv */
+	kcondvar_t		intr_cv;	/* pipes sleep here until a
+						   doorbell arrives */
 	const struct fileops	*pipeops;	/* needed for checking if open 
 						   file has type my_pipe */
 } sharme;
 
-void pipe_lock(bus_size_t lock);
-void pipe_unlock(bus_size_t lock);
-void read_region_1(bus_size_t offset, uint8_t *datap, bus_size_t count);
-void read_region_4(bus_size_t offset, uint32_t *datap, bus_size_t count);
-void write_region_1(bus_size_t offset, uint8_t *datap, bus_size_t count);
-void write_region_4(bus_size_t offset, uint32_t *datap, bus_size_t count);
-
+int my_shm_init(void);
+bus_size_t my_shm_alloc(bus_size_t size);
+void my_shm_free(bus_size_t off, bus_size_t size);
+bus_size_t my_shm_balloc(bus_size_t size);
+int my_shm_bcheck(bus_size_t off, bus_size_t len);
+int my_shm_bfree(bus_size_t off);
+int my_shm_slot_get(bus_size_t ctl);
+void my_shm_slot_put(int slot);
+void my_pipe_init(void);
+void my_pipe_intr(void);
+void my_pipe_forked(void);
+void pipe_lock(uint8_t *lock);
+void pipe_unlock(uint8_t *lock);
+#endif /* _KERNEL */
@@ -0,0 +1,228 @@
+#ifndef _MY_PIPE_RING_H_
+#define _MY_PIPE_RING_H_
+
+/*
+ * Direct access to the ring of a my_pipe from userspace. The application
+ * produces and consumes bytes in place in the shared memory and enters the
+ * kernel only to sleep (MY_PIPE_WAIT) or to wake up a sleeping peer
+ * (MY_PIPE_WAKE), the latter only when somebody sleeps.
+ *
+ * Reader:
+ *	n = my_ring_read_begin(&r, &p);	 up to n bytes can be read at p
+ *	my_ring_read_end(&r, used);
+ * Writer:
+ *	n = my_ring_write_begin(&r, want, &p); n bytes must be written at p
+ *	my_ring_write_end(&r);
+ *
+ * begin returns 0 if there is nothing to do and then the end must not be
+ * called. The ring carries bytes only, in packet mode (MY_PIPE_SETPKT) begin
+ * fails with EINVAL like MY_PIPE_BRECV does on a byte stream; records go
+ * through read(2)/write(2). Between begin and end the reader holds the lock of its side and
+ * the writer holds a reservation that later writers wait for, so keep that
+ * short. begin never returns more than what is left until the end of the
+ * buffer, so a record may come in two pieces. Use read(2)/write(2) if writes
+ * of up to PIPE_BUF bytes must not be mixed with the writes of others.
+ */
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "my_pipe.h"
+
+struct my_ring {
+	int			fd;	/* descriptor of the pipe end */
+	struct my_pipe_map	map;	/* what MY_PIPE_MAP returned */
+	uint32_t		res_idx;	/* reservation of the writer */
+	uint32_t		res_n;
+};
+
+static inline void my_ring_lock(uint8_t *lock)
+{
+	while (__sync_val_compare_and_swap(lock, 0, 1) == 1)
+		__asm__ __volatile__("pause");
+}
+
+static inline void my_ring_unlock(uint8_t *lock)
+{
+	__sync_lock_release(lock);
+}
+
+/*
+ * Get the ring of the pipe end fd
+ */
+static inline int my_ring_attach(struct my_ring *r, int fd)
+{
+	r->fd = fd;
+	return ioctl(fd, MY_PIPE_MAP, &r->map);
+}
+
+/*
+ * Did the other side of the pipe leave?
+ */
+static inline int my_ring_peer_gone(struct my_ring *r)
+{
+	if (r->map.oper == 0)
+		return shm_load_acq(r->map.ctl->nwriters) == 0;
+	return shm_load_acq(r->map.ctl->nreaders) == 0;
+}
+
+/*
+ * Sleep until need bytes (read end) or need free bytes (write end) are
+ * there, or until the other side leaves
+ */
+static inline int my_ring_wait(struct my_ring *r, int need)
+{
+	return ioctl(r->fd, MY_PIPE_WAIT, &need);
+}
+
+/*
+ * Wake up the other side if it sleeps, after we moved our index
+ */
+static inline void my_ring_wake(struct my_ring *r, uint32_t *waiters)
+{
+	int i;
+	__sync_synchronize();
+	for (i = 0; i < MY_PIPE_NWAITERS; i++) {
+		if (shm_load(waiters[i]) != 0) {
+			ioctl(r->fd, MY_PIPE_WAKE, NULL);
+			return;
+		}
+	}
+}
+
+static inline ssize_t my_ring_read_begin(struct my_ring *r, void **p)
+{
+	struct my_pipe_ctl *ctl = r->map.ctl;
+	uint32_t len, head, tail, cnt;
+	my_ring_lock(&ctl->rd_lock);
+	/* the mode only changes under both locks */
+	if (shm_load(ctl->flags) & MY_PIPE_F_PACKET) {
+		my_ring_unlock(&ctl->rd_lock);
+		errno = EINVAL;
+		return -1;
+	}
+	len = ctl->len;
+	tail = ctl->tail;
+	head = shm_load_acq(ctl->head);
+	cnt = head - tail;
+	if (cnt == 0) {
+		my_ring_unlock(&ctl->rd_lock);
+		return 0;
+	}
+	if (cnt > len - (tail & (len - 1)))
+		cnt = len - (tail & (len - 1));
+	*p = r->map.shm + ctl->buf + (tail & (len - 1));
+	return cnt;
+}
+
+static inline void my_ring_read_end(struct my_ring *r, size_t n)
+{
+	struct my_pipe_ctl *ctl = r->map.ctl;
+	shm_store_rel(ctl->tail, ctl->tail + n);
+	my_ring_unlock(&ctl->rd_lock);
+	my_ring_wake(r, ctl->wr_waiters);
+}
+
+static inline ssize_t my_ring_write_begin(struct my_ring *r, size_t want,
+		void **p)
+{
+	struct my_pipe_ctl *ctl = r->map.ctl;
+	uint32_t n;
+	my_pipe_wr_enter(ctl);
+	/* nobody changes the mode while we are active */
+	if (shm_load(ctl->flags) & MY_PIPE_F_PACKET) {
+		my_pipe_wr_exit(ctl);
+		errno = EINVAL;
+		return -1;
+	}
+	if (want > UINT32_MAX)
+		want = UINT32_MAX;
+	n = my_pipe_reserve(ctl, 1, want, 1, &r->res_idx);
+	if (n == 0) {
+		my_pipe_wr_exit(ctl);
+		return 0;
+	}
+	r->res_n = n;
+	*p = r->map.shm + shm_load(ctl->buf) + 
+		(r->res_idx & (shm_load(ctl->len) - 1));
+	return n;
+}
+
+static inline void my_ring_write_end(struct my_ring *r)
+{
+	struct my_pipe_ctl *ctl = r->map.ctl;
+	while (!my_pipe_can_publish(ctl, r->res_idx))
+		__asm__ __volatile__("pause");
+	shm_store_rel(ctl->head, r->res_idx + r->res_n);
+	my_pipe_wr_exit(ctl);
+	my_ring_wake(r, ctl->rd_waiters);
+}
+
+/*
+ * Like read(2), without entering the kernel unless the ring is empty
+ */
+static inline ssize_t my_ring_read(struct my_ring *r, void *buf, size_t n)
+{
+	size_t got = 0;
+	ssize_t cnt;
+	void *p;
+	while (got < n) {
+		cnt = my_ring_read_begin(r, &p);
+		if (cnt < 0)
+			return got > 0 ? (ssize_t)got : -1;
+		if (cnt == 0) {
+			/* return what we have or EOF */
+			if (got > 0)
+				break;
+			if (my_ring_peer_gone(r)) {
+				/* the last writer may have published just
+				 * before it left */
+				if (shm_load_acq(r->map.ctl->head) == 
+						shm_load(r->map.ctl->tail))
+					break;
+				continue;
+			}
+			if (my_ring_wait(r, 1) < 0)
+				return -1;
+			continue;
+		}
+		if ((size_t)cnt > n - got)
+			cnt = n - got;
+		memcpy((char *)buf + got, p, cnt);
+		my_ring_read_end(r, cnt);
+		got += cnt;
+	}
+	return got;
+}
+
+/*
+ * Like write(2), without entering the kernel unless the ring is full
+ */
+static inline ssize_t my_ring_write(struct my_ring *r, const void *buf,
+		size_t n)
+{
+	size_t put = 0;
+	ssize_t cnt;
+	void *p;
+	while (put < n) {
+		if (my_ring_peer_gone(r)) {
+			errno = EPIPE;
+			return -1;
+		}
+		cnt = my_ring_write_begin(r, n - put, &p);
+		if (cnt < 0)
+			return put > 0 ? (ssize_t)put : -1;
+		if (cnt == 0) {
+			if (my_ring_wait(r, 1) < 0)
+				return -1;
+			continue;
+		}
+		memcpy(p, (const char *)buf + put, cnt);
+		my_ring_write_end(r);
+		put += cnt;
+	}
+	return put;
+}
+
+#endif /* _MY_PIPE_RING_H_ */
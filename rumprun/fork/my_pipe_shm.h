@@ -0,0 +1,446 @@
+#ifndef _MY_PIPE_SHM_H_
+#define _MY_PIPE_SHM_H_
+
+/*
+ * Layout of the ivshmem shared memory and of the pipes in it. It is shared by
+ * the kernel, by userspace that uses the ring directly (see
+ * my_pipe_ring.h) and by host/libmypipe.c. Every kernel that attaches to the memory has to agree on
+ * it, so bump MY_SHM_VERSION whenever a struct in here changes.
+ * subr_my_shm.c checks the offsets at compile time.
+ */
+#ifdef _KERNEL
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define	MY_PIPE_NWAITERS	4		/* sleepers per side */
+#define	MY_PIPE_CACHE_LINE	64		/* host cache line size */
+
+#define	MY_SHM_MAGIC		0x4d595348	/* "MYSH" */
+#define	MY_SHM_BUSY		1		/* superblock is being set up */
+#define	MY_SHM_VERSION		3		/* version of this layout */
+#define	MY_SHM_MIN_EXTENT	64U		/* smallest extent */
+#define	MY_SHM_NCLASSES		26		/* extents of 64B up to 2GB */
+#define	MY_SHM_NSLOTS		64		/* max number of pipes */
+
+/*
+ * The shared memory starts with a superblock, the rest is handed out in
+ * extents by my_shm_alloc(). All offsets are from the start of the shared
+ * memory and 0 means none. Fields that are written often get a cache line of
+ * their own: brk is moved by every allocation of new memory and the fork
+ * byte is polled by a parent while its child starts.
+ */
+struct my_shm_sb {
+	uint32_t	magic;		/* MY_SHM_MAGIC when set up */
+	uint32_t	version;	/* MY_SHM_VERSION */
+	uint32_t	len;		/* size of shared memory */
+	uint8_t		pad0[MY_PIPE_CACHE_LINE - 12];
+	uint32_t	brk;		/* start of never used memory */
+	uint8_t		pad1[MY_PIPE_CACHE_LINE - 4];
+	uint8_t		fork;		/* fork handshake byte */
+	uint8_t		pad2[MY_PIPE_CACHE_LINE - 1];
+	uint64_t	free[MY_SHM_NCLASSES];	/* free list heads */
+	uint8_t		pad3[MY_PIPE_CACHE_LINE -
+			    (8 * MY_SHM_NCLASSES) % MY_PIPE_CACHE_LINE];
+	uint32_t	slots[MY_SHM_NSLOTS];	/* control block of each
+						   pipe */
+};
+
+/* offsets of the superblock fields, checked against the struct */
+#define	MY_SHM_SB_MAGIC		0
+#define	MY_SHM_SB_VERSION	4
+#define	MY_SHM_SB_LEN		8
+#define	MY_SHM_SB_BRK		64
+#define	MY_SHM_SB_FORK		128
+#define	MY_SHM_SB_FREE		192		/* 8 bytes per class */
+#define	MY_SHM_SB_SLOTS		448		/* 4 bytes per slot */
+#define	MY_SHM_SB_SIZE		704		/* extents start here */
+
+/*
+ * Control block of a pipe, it is overlaid on the shared memory. Every line
+ * is MY_PIPE_CACHE_LINE bytes, so the producer and the consumer never write
+ * to the same line. The buffer is a separate extent.
+ *
+ * line 0: lock, nreaders, nwriters, flags, len, buf (rarely written)
+ * line 1: wr_lock, head, wr_waiters, prod_head, wr_active (written only by
+ *         the producers)
+ * line 2: rd_lock, tail, rd_waiters (written only by the consumers)
+ *
+ * head and tail are free running byte counters, the number of bytes in the
+ * pipe is head - tail and a byte lives at buf + (index & (len - 1)).
+ * Producers do not lock each other out. A producer reserves space by moving
+ * prod_head with a CAS, copies its bytes and then publishes them by moving
+ * head, after the producers that reserved before it have published theirs.
+ * The single consumer (rd_lock) only looks at head.
+ * len and buf change only when the pipe is resized. The resizer takes
+ * wr_lock, waits until no producer is active (wr_active is the number of
+ * producers between reserve and publish) and takes rd_lock. A producer
+ * raises wr_active and backs off while wr_lock is held.
+ * A side that has to wait drops its lock, stores its ivshmem peer id + 1 in a
+ * free waiter slot and sleeps, the other side rings every peer it finds in
+ * the slots after it moves its index.
+ * Fields that are used without holding their lock must be accessed with the
+ * shm_* macros below.
+ */
+struct my_pipe_ctl {
+	uint8_t		lock;		/* lock for nreaders and nwriters */
+	uint8_t		nreaders;	/* number of readers in pipe */
+	uint8_t		nwriters;	/* number of writers in pipe */
+	uint8_t		flags;		/* MY_PIPE_F_* */
+	uint32_t	len;		/* size of pipe buffer */
+	uint32_t	buf;		/* offset of pipe buffer */
+	uint8_t		pad1[MY_PIPE_CACHE_LINE - 12];
+	uint8_t		wr_lock;	/* held while resizing */
+	uint8_t		pad2[3];
+	uint32_t	head;		/* bytes published in pipe so far */
+	uint32_t	wr_waiters[MY_PIPE_NWAITERS];	/* peer id + 1 of
+							   sleeping writers */
+	uint32_t	prod_head;	/* bytes reserved in pipe so far */
+	uint32_t	wr_active;	/* producers that reserved */
+	uint8_t		pad3[MY_PIPE_CACHE_LINE - 16 - 4 * MY_PIPE_NWAITERS];
+	uint8_t		rd_lock;	/* readers lock */
+	uint8_t		pad4[3];
+	uint32_t	tail;		/* bytes read from pipe so far */
+	uint32_t	rd_waiters[MY_PIPE_NWAITERS];	/* peer id + 1 of
+							   sleeping readers */
+	uint8_t		pad5[MY_PIPE_CACHE_LINE - 8 - 4 * MY_PIPE_NWAITERS];
+};
+#define	MY_PIPE_CTL_SIZE	sizeof(struct my_pipe_ctl)
+
+#define	MY_PIPE_F_PACKET	0x01		/* the pipe carries records */
+
+/*
+ * In packet mode every write is one record: a header with the length and the
+ * type of the data, then the data, padded so that the next record starts at a
+ * multiple of MY_PIPE_REC_ALIGN. Since len is a power of 2, a header never
+ * wraps around the end of the buffer, the data may.
+ */
+#define	MY_PIPE_REC_ALIGN	8
+#define	MY_PIPE_REC_HDR		8		/* uint32_t length, type */
+#define	MY_PIPE_REC_SIZE(n)	((MY_PIPE_REC_HDR + (n) + \
+			MY_PIPE_REC_ALIGN - 1) & ~(MY_PIPE_REC_ALIGN - 1))
+#define	MY_PIPE_REC_DATA	0		/* bytes from write(2) */
+#define	MY_PIPE_REC_BUF		1		/* a struct my_pipe_desc */
+
+/*
+ * A buffer of MY_PIPE_BALLOC is an extent that starts with this header, in a
+ * cache line of its own, followed by the buffer. The header keeps the size
+ * class of the extent, so the buffer goes back to the free list it came from
+ * whatever length the process passes, and marks the extent as a buffer so
+ * that nothing else (a pipe, a freed buffer) can be freed through BFREE.
+ */
+#define	MY_SHM_BUF_MAGIC	0x4d594246	/* "MYBF" */
+#define	MY_SHM_BUF_HDR		MY_PIPE_CACHE_LINE
+
+struct my_shm_buf_hdr {
+	uint32_t	magic;		/* MY_SHM_BUF_MAGIC while allocated */
+	uint32_t	class;		/* size class of the extent */
+};
+
+/* bytes a buffer of an extent of the given class can hold */
+#define	MY_SHM_BUF_CAP(class)	(((uint64_t)MY_SHM_MIN_EXTENT << (class)) - \
+			MY_SHM_BUF_HDR)
+
+/*
+ * A buffer in the shared memory that is passed through a pipe instead of
+ * its contents (MY_PIPE_BSEND). The receiver owns it afterwards.
+ */
+struct my_pipe_desc {
+	uint32_t	off;		/* offset of the buffer */
+	uint32_t	len;		/* bytes in the buffer */
+};
+
+/* the shared memory is mapped cacheable, so plain atomics order it */
+#define	shm_load(f)		__atomic_load_n(&(f), __ATOMIC_RELAXED)
+#define	shm_load_acq(f)		__atomic_load_n(&(f), __ATOMIC_ACQUIRE)
+#define	shm_store(f, v)		__atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+#define	shm_store_rel(f, v)	__atomic_store_n(&(f), (v), __ATOMIC_RELEASE)
+
+/*
+ * A producer enters before it reserves space and exits after it publishes
+ * it. Entering waits while the pipe is being resized.
+ */
+static inline void my_pipe_wr_enter(struct my_pipe_ctl *ctl)
+{
+	for (;;) {
+		__atomic_fetch_add(&ctl->wr_active, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctl->wr_lock, __ATOMIC_SEQ_CST) == 0)
+			return;
+		__atomic_fetch_sub(&ctl->wr_active, 1, __ATOMIC_RELEASE);
+		while (shm_load(ctl->wr_lock) != 0)
+			__asm__ __volatile__("pause");
+	}
+}
+
+static inline void my_pipe_wr_exit(struct my_pipe_ctl *ctl)
+{
+	__atomic_fetch_sub(&ctl->wr_active, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reserve up to want bytes, if at least min bytes are free. With contig the
+ * reservation does not cross the end of the buffer. Returns the number of
+ * bytes reserved, starting at index *idx, or 0.
+ */
+static inline uint32_t my_pipe_reserve(struct my_pipe_ctl *ctl, uint32_t min,
+		uint32_t want, int contig, uint32_t *idx)
+{
+	uint32_t len, ph, tail, n;
+	len = shm_load(ctl->len);
+	for (;;) {
+		ph = shm_load(ctl->prod_head);
+		/* the consumer must be done with the space we reserve */
+		tail = shm_load_acq(ctl->tail);
+		n = len - (ph - tail);
+		/* ph is stale if the consumer is already past it */
+		if (n > len)
+			continue;
+		if (n < min)
+			return 0;
+		if (contig && n > len - (ph & (len - 1)))
+			n = len - (ph & (len - 1));
+		if (n > want)
+			n = want;
+		if (__atomic_compare_exchange_n(&ctl->prod_head, &ph, ph + n,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	*idx = ph;
+	return n;
+}
+
+/*
+ * Has every producer that reserved before idx published its bytes?
+ */
+static inline int my_pipe_can_publish(struct my_pipe_ctl *ctl, uint32_t idx)
+{
+	return shm_load_acq(ctl->head) == idx;
+}
+
+/*
+ * The allocator of subr_my_shm.c and the records of packet mode, for the
+ * kernel and for host/libmypipe.c. base is the shared memory as the caller
+ * maps it and shm_len its size. Whatever they read from the memory was
+ * written by somebody else, so offsets are checked against shm_len before
+ * they are followed.
+ */
+
+/* size class of an extent that can hold size bytes */
+static inline int my_shm_class(uint64_t size)
+{
+	int class = 0;
+	while (((uint64_t)MY_SHM_MIN_EXTENT << class) < size)
+		class++;
+	return class;
+}
+
+/*
+ * Allocate an extent of at least size bytes, aligned to a cache line.
+ * Returns its offset or 0 if there is not enough memory.
+ */
+static inline uint32_t my_shm_ext_alloc(uint8_t *base, uint64_t shm_len,
+		uint64_t size)
+{
+	struct my_shm_sb *sb = (struct my_shm_sb *)base;
+	int class = my_shm_class(size);
+	uint64_t old, new;
+	uint32_t off, next, brk, end;
+	if (class >= MY_SHM_NCLASSES)
+		return 0;
+	/* reuse a freed extent of the same size */
+	for (;;) {
+		old = shm_load(sb->free[class]);
+		off = (uint32_t)old;
+		if (off == 0)
+			break;
+		/* the first word of a free extent links it to the next one */
+		if (off < MY_SHM_SB_SIZE || off > shm_len - MY_SHM_MIN_EXTENT)
+			return 0;
+		next = shm_load(*(uint32_t *)(base + off));
+		new = ((old >> 32) + 1) << 32 | next;
+		if (__sync_bool_compare_and_swap(&sb->free[class], old, new))
+			return off;
+	}
+	/* carve a new extent from memory that was never used */
+	for (;;) {
+		brk = shm_load(sb->brk);
+		end = brk + (MY_SHM_MIN_EXTENT << class);
+		if (brk < MY_SHM_SB_SIZE || end < brk || end > shm_len)
+			return 0;
+		if (__sync_bool_compare_and_swap(&sb->brk, brk, end))
+			return brk;
+	}
+}
+
+/*
+ * Give back an extent that my_shm_ext_alloc() returned for size bytes
+ */
+static inline void my_shm_ext_free(uint8_t *base, uint32_t off, uint64_t size)
+{
+	struct my_shm_sb *sb = (struct my_shm_sb *)base;
+	int class = my_shm_class(size);
+	uint64_t old, new;
+	if (class >= MY_SHM_NCLASSES)
+		return;
+	for (;;) {
+		old = shm_load(sb->free[class]);
+		shm_store(*(uint32_t *)(base + off), (uint32_t)old);
+		new = ((old >> 32) + 1) << 32 | off;
+		if (__sync_bool_compare_and_swap(&sb->free[class], old, new))
+			return;
+	}
+}
+
+/*
+ * Allocate a buffer of size bytes behind its header. Returns the offset of
+ * the buffer or 0.
+ */
+static inline uint32_t my_shm_buf_alloc(uint8_t *base, uint64_t shm_len,
+		uint64_t size)
+{
+	struct my_shm_buf_hdr *hdr;
+	uint32_t off;
+	if (size == 0 || size > MY_SHM_BUF_CAP(MY_SHM_NCLASSES - 1))
+		return 0;
+	if ((off = my_shm_ext_alloc(base, shm_len, size + MY_SHM_BUF_HDR)) == 0)
+		return 0;
+	hdr = (struct my_shm_buf_hdr *)(base + off);
+	hdr->class = my_shm_class(size + MY_SHM_BUF_HDR);
+	shm_store_rel(hdr->magic, MY_SHM_BUF_MAGIC);
+	return off + MY_SHM_BUF_HDR;
+}
+
+/*
+ * The size class of the buffer of len bytes at off, -1 if no buffer is there
+ * or it is smaller than len
+ */
+static inline int my_shm_buf_class(uint8_t *base, uint64_t shm_len,
+		uint64_t off, uint64_t len)
+{
+	struct my_shm_buf_hdr *hdr;
+	uint32_t class;
+	if (off < MY_SHM_SB_SIZE + MY_SHM_BUF_HDR ||
+			off % MY_SHM_MIN_EXTENT != 0 || off >= shm_len)
+		return -1;
+	hdr = (struct my_shm_buf_hdr *)(base + off - MY_SHM_BUF_HDR);
+	class = shm_load(hdr->class);
+	if (shm_load_acq(hdr->magic) != MY_SHM_BUF_MAGIC ||
+			class >= MY_SHM_NCLASSES ||
+			len > MY_SHM_BUF_CAP(class) ||
+			off + MY_SHM_BUF_CAP(class) > shm_len)
+		return -1;
+	return class;
+}
+
+/*
+ * Give back the buffer at off by the class it was allocated with. Only the
+ * one that clears the magic frees it, so a buffer is not freed twice.
+ * Returns 0 or -1 if there is no buffer at off.
+ */
+static inline int my_shm_buf_free(uint8_t *base, uint64_t shm_len,
+		uint64_t off)
+{
+	struct my_shm_buf_hdr *hdr;
+	int class = my_shm_buf_class(base, shm_len, off, 0);
+	if (class < 0)
+		return -1;
+	hdr = (struct my_shm_buf_hdr *)(base + off - MY_SHM_BUF_HDR);
+	if (!__sync_bool_compare_and_swap(&hdr->magic, MY_SHM_BUF_MAGIC, 0))
+		return -1;
+	my_shm_ext_free(base, off - MY_SHM_BUF_HDR,
+			(uint64_t)MY_SHM_MIN_EXTENT << class);
+	return 0;
+}
+
+/*
+ * Do the buffer offset and the length of a control block describe a ring in
+ * the shared memory?
+ */
+static inline int my_pipe_ctl_ok(uint32_t buf, uint32_t len, uint64_t shm_len)
+{
+	return len >= MY_SHM_MIN_EXTENT && (len & (len - 1)) == 0 &&
+		buf >= MY_SHM_SB_SIZE && buf <= shm_len && len <= shm_len - buf;
+}
+
+/* length of the record at idx of the ring buf of len bytes */
+static inline uint32_t my_pipe_rec_len(const uint8_t *buf, uint32_t len,
+		uint32_t idx)
+{
+	return *(const uint32_t *)(buf + (idx & (len - 1)));
+}
+
+/* type of the record at idx */
+static inline uint32_t my_pipe_rec_type(const uint8_t *buf, uint32_t len,
+		uint32_t idx)
+{
+	return *(const uint32_t *)(buf + (idx & (len - 1)) + 4);
+}
+
+/* write the header of a record of n bytes at idx, the header never wraps */
+static inline void my_pipe_rec_put(uint8_t *buf, uint32_t len, uint32_t idx,
+		uint32_t n, uint32_t type)
+{
+	*(uint32_t *)(buf + (idx & (len - 1))) = n;
+	*(uint32_t *)(buf + (idx & (len - 1)) + 4) = type;
+}
+
+/* the descriptor of a MY_PIPE_REC_BUF record, 8 bytes do not wrap either */
+static inline struct my_pipe_desc *my_pipe_rec_desc(uint8_t *buf,
+		uint32_t len, uint32_t idx)
+{
+	return (struct my_pipe_desc *)(buf +
+			((idx + MY_PIPE_REC_HDR) & (len - 1)));
+}
+
+/*
+ * Is rec, the length in the header at tail, a record that lies within the
+ * head - tail bytes in the pipe?
+ */
+static inline int my_pipe_rec_ok(uint32_t len, uint32_t tail, uint32_t head,
+		uint32_t rec)
+{
+	uint32_t n = head - tail;
+	return tail % MY_PIPE_REC_ALIGN == 0 && n <= len &&
+		n >= MY_PIPE_REC_HDR && rec <= n - MY_PIPE_REC_HDR;
+}
+
+/*
+ * Free the buffers that are still in a pipe that nobody uses any more. The
+ * walk stops at the first record that does not make sense.
+ */
+static inline void my_pipe_bdrain(uint8_t *base, uint64_t shm_len,
+		struct my_pipe_ctl *ctl)
+{
+	uint32_t off, len, head, tail, rec;
+	uint8_t *buf;
+	if (!(shm_load(ctl->flags) & MY_PIPE_F_PACKET))
+		return;
+	off = shm_load(ctl->buf);
+	len = shm_load(ctl->len);
+	if (!my_pipe_ctl_ok(off, len, shm_len))
+		return;
+	buf = base + off;
+	head = shm_load(ctl->head);
+	for (tail = shm_load(ctl->tail); tail != head;
+			tail += MY_PIPE_REC_SIZE(rec)) {
+		rec = my_pipe_rec_len(buf, len, tail);
+		if (!my_pipe_rec_ok(len, tail, head, rec))
+			break;
+		if (my_pipe_rec_type(buf, len, tail) == MY_PIPE_REC_BUF)
+			my_shm_buf_free(base, shm_len,
+					my_pipe_rec_desc(buf, len, tail)->off);
+	}
+}
+
+/*
+ * What MY_PIPE_MAP returns. Rumprun runs the application in the address
+ * space of the kernel, so the pointers can be used as they are.
+ */
+struct my_pipe_map {
+	uint8_t			*shm;		/* start of shared memory */
+	struct my_pipe_ctl	*ctl;		/* control block of the pipe */
+	int			oper;		/* 0 for read, 1 for write end */
+};
+
+#endif /* _MY_PIPE_SHM_H_ */
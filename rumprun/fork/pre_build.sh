@@ -86,10 +86,14 @@ then
 	cd $DIR
 	echo "cp my_pipe.h ${RUMPRUN_REPO}/src-netbsd/sys/kern/"
 	cp my_pipe.h ${RUMPRUN_REPO}/src-netbsd/sys/kern/
+	echo "cp my_pipe_shm.h ${RUMPRUN_REPO}/src-netbsd/sys/kern/"
+	cp my_pipe_shm.h ${RUMPRUN_REPO}/src-netbsd/sys/kern/
 	echo "cp sys_my_pipe.c ${RUMPRUN_REPO}/src-netbsd/sys/kern/"
 	cp sys_my_pipe.c ${RUMPRUN_REPO}/src-netbsd/sys/kern/
 	echo "cp sys_my_fork.c ${RUMPRUN_REPO}/src-netbsd/sys/kern/"
 	cp sys_my_fork.c ${RUMPRUN_REPO}/src-netbsd/sys/kern/
+	echo "cp subr_my_shm.c ${RUMPRUN_REPO}/src-netbsd/sys/kern/"
+	cp subr_my_shm.c ${RUMPRUN_REPO}/src-netbsd/sys/kern/
 	echo "cp Makefile.rumpkern ${RUMPRUN_REPO}/src-netbsd/sys/rump/librump/rumpkern/"
 	cp Makefile.rumpkern ${RUMPRUN_REPO}/src-netbsd/sys/rump/librump/rumpkern/
 	echo "cp rumpkern_syscalls.c ${RUMPRUN_REPO}/src-netbsd/sys/rump/librump/rumpkern"
@@ -78,6 +78,7 @@ extern sy_call_t sys_kqueue1;
 extern sy_call_t sys_clock_nanosleep;
 extern sy_call_t sys_my_pipe;
 extern sy_call_t sys_my_fork;
+extern sy_call_t sys_my_pipe2;
 
 static const struct rump_onesyscall mysys[] = {
 	{ 3,	sys_read },
@@ -149,6 +150,7 @@ static const struct rump_onesyscall mysys[] = {
 	{ 477,	sys_clock_nanosleep },
 	{ 483,	sys_my_pipe },
 	{ 484,	sys_my_fork },
+	{ 485,	sys_my_pipe2 },
 };
 
 RUMP_COMPONENT(RUMP_COMPONENT_SYSCALL)
@@ -0,0 +1,232 @@
+/*
+ * Throughput and latency of my_pipe without VMs, between two threads. For
+ * every size the client thread first plays ping-pong with an echo thread over
+ * two pipes, one message in flight at a time, and times the round trips.
+ * Then it streams messages back to back through one pipe for the MB/s, which
+ * is not timed per message: there a message waits behind the ones before it.
+ *
+ *	bench [-b pipe size] [-t MB per size] [-n iters] [-s spin] [-p] [-k]
+ *		[size ...]
+ *	-p	no doorbells, poll once per tick like ivshmem-plain
+ *	-k	packet mode
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "../my_pipe.h"
+
+#define	SHM_SIZE	(64 << 20)
+#define	WARMUP		16		/* round trips we do not count */
+
+struct run {
+	int		fd[2];		/* client to echo, or the stream */
+	int		back[2];	/* echo to client */
+	size_t		size;		/* bytes per message */
+	size_t		nmsg;		/* messages of the stream */
+	int		iters;		/* round trips of the ping-pong */
+	uint64_t	*lat;		/* round trip of every ping in ns */
+};
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+//read a whole message, a stream pipe may return it in pieces
+static int read_msg(int fd, char *buf, size_t size)
+{
+	size_t got;
+	ssize_t n;
+	for (got = 0; got < size; got += n) {
+		n = sim_read(fd, buf + got, size - got);
+		if (n <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void write_msg(int fd, const char *buf, size_t size)
+{
+	if (sim_write(fd, buf, size) != (ssize_t)size)
+		die("write");
+}
+
+static void open_pipe(int fd[2], int flags, int bufsz)
+{
+	if (sim_pipe(fd, flags) < 0)
+		die("my_pipe2");
+	if (bufsz > 0 && sim_ioctl(fd[0], MY_PIPE_SETSZ, &bufsz) < 0)
+		die("MY_PIPE_SETSZ");
+}
+
+//send every message back until the client leaves
+static void *echo(void *arg)
+{
+	struct run *r = arg;
+	char *buf = malloc(r->size);
+	if (buf == NULL)
+		die("malloc");
+	while (read_msg(r->fd[0], buf, r->size) == 0)
+		write_msg(r->back[1], buf, r->size);
+	sim_close(r->back[1]);
+	free(buf);
+	return NULL;
+}
+
+static void pingpong(struct run *r, int flags, int bufsz)
+{
+	char *buf = calloc(1, r->size);
+	pthread_t et;
+	uint64_t t;
+	int i;
+	if (buf == NULL)
+		die("calloc");
+	open_pipe(r->fd, flags, bufsz);
+	open_pipe(r->back, flags, bufsz);
+	pthread_create(&et, NULL, echo, r);
+	for (i = 0; i < WARMUP + r->iters; i++) {
+		t = now();
+		write_msg(r->fd[1], buf, r->size);
+		if (read_msg(r->back[0], buf, r->size) < 0)
+			die("read");
+		if (i >= WARMUP)
+			r->lat[i - WARMUP] = now() - t;
+	}
+	sim_close(r->fd[1]);
+	pthread_join(et, NULL);
+	sim_close(r->fd[0]);
+	sim_close(r->back[0]);
+	free(buf);
+}
+
+static void *writer(void *arg)
+{
+	struct run *r = arg;
+	char *buf = calloc(1, r->size);
+	size_t i;
+	if (buf == NULL)
+		die("calloc");
+	for (i = 0; i < r->nmsg; i++)
+		write_msg(r->fd[1], buf, r->size);
+	sim_close(r->fd[1]);
+	free(buf);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct run *r = arg;
+	char *buf = malloc(r->size);
+	size_t i;
+	if (buf == NULL)
+		die("malloc");
+	for (i = 0; i < r->nmsg; i++)
+		if (read_msg(r->fd[0], buf, r->size) < 0)
+			die("read");
+	free(buf);
+	return NULL;
+}
+
+//seconds it takes to stream all the messages
+static double stream(struct run *r, int flags, int bufsz)
+{
+	pthread_t rt, wt;
+	uint64_t t;
+	open_pipe(r->fd, flags, bufsz);
+	t = now();
+	pthread_create(&rt, NULL, reader, r);
+	pthread_create(&wt, NULL, writer, r);
+	pthread_join(wt, NULL);
+	pthread_join(rt, NULL);
+	t = now() - t;
+	sim_close(r->fd[0]);
+	return t / 1e9;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(struct run *r, double p)
+{
+	return r->lat[(size_t)(p * (r->iters - 1))] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 64, 512, 4096, 65536 };
+	struct run r;
+	size_t total = 64 << 20;
+	int opt, i, nsizes, bufsz = 0, polling = 0, flags = 0;
+	double sec;
+	r.iters = 10000;
+	while ((opt = getopt(argc, argv, "b:t:n:s:pk")) != -1) {
+		switch (opt) {
+			case 'b':
+				bufsz = atoi(optarg);
+				break;
+			case 't':
+				total = (size_t)atoi(optarg) << 20;
+				break;
+			case 'n':
+				r.iters = atoi(optarg);
+				break;
+			case 's':
+				my_pipe_spin_max = atoi(optarg);
+				break;
+			case 'p':
+				polling = 1;
+				break;
+			case 'k':
+				flags |= O_DIRECT;
+				break;
+			default:
+				fprintf(stderr, "usage: bench [-b pipe size] "
+						"[-t MB] [-n iters] [-s spin] "
+						"[-p] [-k] [size ...]\n");
+				return 1;
+		}
+	}
+	if (r.iters < 1)
+		r.iters = 1;
+	sim_attach(SHM_SIZE, !polling);
+	nsizes = argc > optind ? argc - optind : 4;
+	if ((r.lat = malloc(r.iters * sizeof(*r.lat))) == NULL)
+		die("malloc");
+	printf("size\tmsgs\tMB/s\trtt p50 us\trtt p99 us\trtt p99.9 us\n");
+	for (i = 0; i < nsizes; i++) {
+		r.size = argc > optind ? strtoul(argv[optind + i], NULL, 0) :
+			sizes[i];
+		if (r.size == 0)
+			r.size = 1;
+		r.nmsg = total / r.size;
+		if (r.nmsg == 0)
+			r.nmsg = 1;
+		pingpong(&r, flags, bufsz);
+		sec = stream(&r, flags, bufsz);
+		qsort(r.lat, r.iters, sizeof(*r.lat), cmp);
+		printf("%zu\t%zu\t%.1f\t%.1f\t\t%.1f\t\t%.1f\n", r.size,
+				r.nmsg, r.size * r.nmsg / sec / (1 << 20),
+				pct(&r, 0.5), pct(&r, 0.99), pct(&r, 0.999));
+	}
+	free(r.lat);
+	return 0;
+}
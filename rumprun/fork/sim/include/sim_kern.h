@@ -0,0 +1,203 @@
+#ifndef _SIM_KERN_H_
+#define _SIM_KERN_H_
+
+/*
+ * Just enough of the NetBSD kernel interfaces for sys_my_pipe.c and
+ * subr_my_shm.c to build as a Linux program. The headers in sys/ of this
+ * directory all end up here, sim.c implements the functions.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include_next <sys/uio.h>
+#include_next <sys/queue.h>
+#include_next <poll.h>
+
+typedef unsigned long	bus_size_t;
+typedef unsigned long	bus_addr_t;
+typedef int		bus_space_tag_t;	/* SIM_MEM or SIM_REG */
+typedef unsigned long	bus_space_handle_t;	/* address of the space */
+typedef long		register_t;
+typedef void		*kauth_cred_t;
+typedef unsigned int	u_int;
+typedef unsigned long	u_long;
+
+#define	SIM_MEM		0		/* tag of the shared memory */
+#define	SIM_REG		1		/* tag of the ivshmem registers */
+
+#ifndef O_NOSIGPIPE
+#define	O_NOSIGPIPE	0x01000000
+#endif
+#ifndef EPROGMISMATCH
+#define	EPROGMISMATCH	1000
+#endif
+#define	PIPE_BUF	512		/* the one of NetBSD */
+#define	FIONSPACE	_IOR('f', 120, int)
+#ifndef POLLRDNORM
+#define	POLLRDNORM	0x040
+#define	POLLWRNORM	0x100
+#endif
+#define	roundup(x, y)	((((x) + ((y) - 1)) / (y)) * (y))
+#define	MIN(a, b)	((a) < (b) ? (a) : (b))
+#define	CTASSERT(x)	_Static_assert(x, #x)
+
+/* uio */
+enum uio_rw { UIO_READ, UIO_WRITE };
+struct uio {
+	struct iovec	*uio_iov;
+	int		uio_iovcnt;
+	off_t		uio_offset;
+	size_t		uio_resid;
+	enum uio_rw	uio_rw;
+	void		*uio_vmspace;
+};
+#define	UIO_SETUP_SYSSPACE(uio)	((uio)->uio_vmspace = NULL)
+int uiomove(void *, size_t, struct uio *);
+int copyin(const void *, void *, size_t);
+int copyout(const void *, void *, size_t);
+
+/* files */
+struct knote;
+struct file;
+typedef struct file file_t;
+struct fileops {
+	int	(*fo_read)(file_t *, off_t *, struct uio *, kauth_cred_t, int);
+	int	(*fo_write)(file_t *, off_t *, struct uio *, kauth_cred_t, int);
+	int	(*fo_ioctl)(file_t *, u_long, void *);
+	int	(*fo_fcntl)(file_t *, u_int, void *);
+	int	(*fo_poll)(file_t *, int);
+	int	(*fo_stat)(file_t *, void *);
+	int	(*fo_close)(file_t *);
+	int	(*fo_kqfilter)(file_t *, struct knote *);
+	void	(*fo_restart)(file_t *);
+};
+struct file {
+	int			f_flag;
+	int			f_type;
+	const struct fileops	*f_ops;
+	void			*f_data;
+};
+#define	FREAD		1
+#define	FWRITE		2
+#define	DTYPE_MISC	7
+struct proc { void *p_vmspace; };
+struct lwp { struct proc *l_proc; };
+extern struct proc *curproc;
+extern struct lwp *curlwp;
+int fd_allocfile(file_t **, int *);
+void fd_abort(struct proc *, file_t *, int);
+void fd_affix(struct proc *, file_t *, int);
+void fd_set_exclose(struct lwp *, int, bool);
+
+/* syscall arguments, as makesyscalls.sh would generate them */
+struct sys_my_pipe_args { struct { int *datum; } fildes; };
+struct sys_my_pipe2_args {
+	struct { int *datum; } fildes;
+	struct { int datum; } flags;
+};
+#define	SCARG(p, k)	((p)->k.datum)
+
+/* memory */
+#define	M_TEMP		0
+#define	M_WAITOK	0
+#define	M_ZERO		0
+void *kern_malloc(unsigned long, int, int);
+void kern_free(void *, int);
+#define	malloc(size, type, flags)	kern_malloc(size, type, flags)
+#define	free(addr, type)		kern_free(addr, type)
+
+/* bus_space on plain memory, writes to DOORBELL ring ourselves */
+uint8_t bus_space_read_1(bus_space_tag_t, bus_space_handle_t, bus_size_t);
+uint32_t bus_space_read_4(bus_space_tag_t, bus_space_handle_t, bus_size_t);
+void bus_space_write_1(bus_space_tag_t, bus_space_handle_t, bus_size_t,
+		uint8_t);
+void bus_space_write_4(bus_space_tag_t, bus_space_handle_t, bus_size_t,
+		uint32_t);
+#define	membar_consumer()	__sync_synchronize()
+#define	membar_producer()	__sync_synchronize()
+#define	membar_sync()		__sync_synchronize()
+
+/* locking and sleeping */
+typedef struct { pthread_mutex_t m; } kmutex_t;
+typedef struct { pthread_cond_t c; } kcondvar_t;
+#define	MUTEX_DEFAULT	0
+#define	IPL_NONE	0
+#define	IPL_VM		1
+extern int hz;
+extern int hardclock_ticks;
+void mutex_init(kmutex_t *, int, int);
+void mutex_enter(kmutex_t *);
+void mutex_exit(kmutex_t *);
+void cv_init(kcondvar_t *, const char *);
+void cv_broadcast(kcondvar_t *);
+int cv_timedwait_sig(kcondvar_t *, kmutex_t *, int);
+int kpause(const char *, bool, int, kmutex_t *);
+#define	kpreempt_disable()	do { } while (0)
+#define	kpreempt_enable()	do { } while (0)
+
+/* select and kqueue, nobody polls in the simulation */
+SLIST_HEAD(klist, knote);
+struct selinfo {
+	struct klist	sel_klist;
+	struct lwp	*sel_lwp;
+	uint32_t	sel_collision;
+};
+struct filterops {
+	int	f_isfd;
+	int	(*f_attach)(struct knote *);
+	void	(*f_detach)(struct knote *);
+	int	(*f_event)(struct knote *, long);
+};
+struct knote {
+	SLIST_ENTRY(knote)	kn_selnext;
+	void			*kn_hook;
+	int64_t			kn_data;
+	int			kn_flags;
+	int			kn_filter;
+	const struct filterops	*kn_fop;
+};
+#define	EVFILT_READ	0
+#define	EVFILT_WRITE	1
+#define	EV_EOF		0x8000
+#define	selinit(sip)		SLIST_INIT(&(sip)->sel_klist)
+#define	seldestroy(sip)		do { } while (0)
+#define	selrecord(l, sip)	do { } while (0)
+#define	selnotify(sip, ev, kn)	do { } while (0)
+
+/* softints run at once, callouts never */
+typedef struct { int unused; } callout_t;
+#define	CALLOUT_MPSAFE	1
+#define	SOFTINT_CLOCK	1
+#define	SOFTINT_MPSAFE	2
+void *softint_establish(int, void (*)(void *), void *);
+void softint_schedule(void *);
+static inline void callout_init(callout_t *c, int flags) { }
+static inline void callout_setfunc(callout_t *c, void (*fn)(void *),
+		void *arg) { }
+static inline void callout_schedule(callout_t *c, int ticks) { }
+
+/* sysctl nodes are not created */
+struct sysctllog;
+struct sysctlnode;
+#define	SYSCTL_SETUP(name, desc) \
+	void name(struct sysctllog **clog); \
+	void name(struct sysctllog **clog)
+#define	SYSCTL_DESCR(s)		s
+#define	CTLFLAG_PERMANENT	0x01
+#define	CTLFLAG_READWRITE	0x02
+#define	CTLTYPE_NODE		1
+#define	CTLTYPE_INT		2
+#define	CTL_KERN		1
+#define	CTL_CREATE		(-3)
+#define	CTL_EOL			(-1)
+int sysctl_createv(struct sysctllog **, int, const struct sysctlnode **,
+		const struct sysctlnode **, int, int, const char *, const char *,
+		void *, unsigned long, void *, size_t, ...);
+
+#endif /* _SIM_KERN_H_ */
@@ -0,0 +1 @@
+#include "../sim_kern.h"
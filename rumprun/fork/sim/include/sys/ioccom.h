@@ -0,0 +1 @@
+#include <sys/ioctl.h>
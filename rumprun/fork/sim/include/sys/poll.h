@@ -0,0 +1,2 @@
+#include_next <sys/poll.h>
+#include "../sim_kern.h"
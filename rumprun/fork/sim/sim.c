@@ -0,0 +1,361 @@
+/*
+ * The kernel interfaces of sim_kern.h and the system calls of sim.h
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sim_kern.h"
+#include "../my_pipe.h"
+#include "sim.h"
+
+#undef malloc
+#undef free
+
+#define	SIM_NFILES	64
+
+int sys_my_pipe2(struct lwp *, const struct sys_my_pipe2_args *, 
+		register_t *);
+
+int hz = 100;
+int hardclock_ticks;
+static struct proc proc0;
+static struct lwp lwp0 = { &proc0 };
+struct proc *curproc = &proc0;
+struct lwp *curlwp = &lwp0;
+
+static file_t *files[SIM_NFILES];
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *kern_malloc(unsigned long size, int type, int flags)
+{
+	void *p = calloc(1, size);
+	if (p == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+void kern_free(void *p, int type)
+{
+	free(p);
+}
+
+/*
+ * Kernel and user memory are the same, so copying is a memcpy
+ */
+int uiomove(void *buf, size_t n, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t cnt;
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+		cnt = iov->iov_len < n ? iov->iov_len : n;
+		if (uio->uio_rw == UIO_READ)
+			memcpy(iov->iov_base, buf, cnt);
+		else
+			memcpy(buf, iov->iov_base, cnt);
+		iov->iov_base = (char *)iov->iov_base + cnt;
+		iov->iov_len -= cnt;
+		uio->uio_resid -= cnt;
+		uio->uio_offset += cnt;
+		buf = (char *)buf + cnt;
+		n -= cnt;
+	}
+	return 0;
+}
+
+int copyin(const void *uaddr, void *kaddr, size_t len)
+{
+	memcpy(kaddr, uaddr, len);
+	return 0;
+}
+
+int copyout(const void *kaddr, void *uaddr, size_t len)
+{
+	memcpy(uaddr, kaddr, len);
+	return 0;
+}
+
+int fd_allocfile(file_t **fpp, int *fdp)
+{
+	int fd;
+	pthread_mutex_lock(&files_lock);
+	for (fd = 0; fd < SIM_NFILES; fd++) {
+		if (files[fd] == NULL) {
+			files[fd] = kern_malloc(sizeof(file_t), M_TEMP, M_WAITOK);
+			*fpp = files[fd];
+			*fdp = fd;
+			pthread_mutex_unlock(&files_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+	return EMFILE;
+}
+
+void fd_abort(struct proc *p, file_t *fp, int fd)
+{
+	pthread_mutex_lock(&files_lock);
+	files[fd] = NULL;
+	pthread_mutex_unlock(&files_lock);
+	free(fp);
+}
+
+void fd_affix(struct proc *p, file_t *fp, int fd)
+{
+}
+
+void fd_set_exclose(struct lwp *l, int fd, bool exclose)
+{
+}
+
+static file_t *sim_getfile(int fd)
+{
+	if (fd < 0 || fd >= SIM_NFILES || files[fd] == NULL)
+		return NULL;
+	return files[fd];
+}
+
+uint8_t bus_space_read_1(bus_space_tag_t t, bus_space_handle_t h, 
+		bus_size_t off)
+{
+	return *(volatile uint8_t *)(h + off);
+}
+
+uint32_t bus_space_read_4(bus_space_tag_t t, bus_space_handle_t h, 
+		bus_size_t off)
+{
+	return *(volatile uint32_t *)(h + off);
+}
+
+void bus_space_write_1(bus_space_tag_t t, bus_space_handle_t h, 
+		bus_size_t off, uint8_t v)
+{
+	*(volatile uint8_t *)(h + off) = v;
+}
+
+/*
+ * There is only one peer, so every doorbell is for us
+ */
+void bus_space_write_4(bus_space_tag_t t, bus_space_handle_t h, 
+		bus_size_t off, uint32_t v)
+{
+	if (t == SIM_REG) {
+		if (off == IVSHMEM_DOORBELL)
+			my_pipe_intr();
+		return;
+	}
+	*(volatile uint32_t *)(h + off) = v;
+}
+
+int sysctl_createv(struct sysctllog **log, int flags, 
+		const struct sysctlnode **rnode, const struct sysctlnode **cnode,
+		int cflags, int type, const char *name, const char *desc,
+		void *func, unsigned long qv, void *newp, size_t newlen, ...)
+{
+	return 0;
+}
+
+void mutex_init(kmutex_t *mtx, int type, int ipl)
+{
+	pthread_mutex_init(&mtx->m, NULL);
+}
+
+void mutex_enter(kmutex_t *mtx)
+{
+	pthread_mutex_lock(&mtx->m);
+}
+
+void mutex_exit(kmutex_t *mtx)
+{
+	pthread_mutex_unlock(&mtx->m);
+}
+
+void cv_init(kcondvar_t *cv, const char *wmesg)
+{
+	pthread_cond_init(&cv->c, NULL);
+}
+
+void cv_broadcast(kcondvar_t *cv)
+{
+	pthread_cond_broadcast(&cv->c);
+}
+
+static void sim_deadline(struct timespec *ts, int ticks)
+{
+	long ns = 1000000000L / hz * ticks;
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ns / 1000000000L;
+	ts->tv_nsec += ns % 1000000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+int cv_timedwait_sig(kcondvar_t *cv, kmutex_t *mtx, int ticks)
+{
+	struct timespec ts;
+	sim_deadline(&ts, ticks);
+	if (pthread_cond_timedwait(&cv->c, &mtx->m, &ts) == ETIMEDOUT)
+		return EWOULDBLOCK;
+	return 0;
+}
+
+int kpause(const char *wmesg, bool intr, int ticks, kmutex_t *mtx)
+{
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000L / hz * ticks;
+	nanosleep(&ts, NULL);
+	return EWOULDBLOCK;
+}
+
+struct sim_softint {
+	void	(*func)(void *);
+	void	*arg;
+};
+
+void *softint_establish(int flags, void (*func)(void *), void *arg)
+{
+	struct sim_softint *si = kern_malloc(sizeof(*si), M_TEMP, M_WAITOK);
+	si->func = func;
+	si->arg = arg;
+	return si;
+}
+
+void softint_schedule(void *cookie)
+{
+	struct sim_softint *si = cookie;
+	si->func(si->arg);
+}
+
+/*
+ * What ivshmem.c does at attach time, on a memfd of size bytes. Without
+ * doorbells the pipes poll once per tick like with ivshmem-plain.
+ */
+void sim_attach(size_t size, int doorbells)
+{
+	int fd;
+	void *p;
+	fd = memfd_create("ivshmem", 0);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		perror("memfd");
+		exit(1);
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	sharme.data_s = size;
+	sharme.data_b = p;
+	sharme.data_t = SIM_MEM;
+	sharme.data_h = (bus_space_handle_t)p;
+	sharme.reg_t = SIM_REG;
+	sharme.reg_h = 0;
+	sharme.peer = doorbells ? 0 : -1;
+	for (sharme.pipe_size = MY_PIPE_BUF_SIZE; 
+			sharme.pipe_size * 2 <= size / 16; 
+			sharme.pipe_size *= 2)
+		/* do nothing */;
+	mutex_init(&sharme.intr_lock, MUTEX_DEFAULT, IPL_VM);
+	cv_init(&sharme.intr_cv, "mypipe");
+	my_pipe_init();
+}
+
+/*
+ * The system calls. Like in sys_generic.c, a read or write that was
+ * interrupted after it moved some bytes returns their number.
+ */
+int sim_pipe(int fd[2], int flags)
+{
+	struct sys_my_pipe2_args ua;
+	register_t rv;
+	int error;
+	ua.fildes.datum = fd;
+	ua.flags.datum = flags;
+	if ((error = sys_my_pipe2(curlwp, &ua, &rv)) != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t sim_rw(int fd, void *buf, size_t n, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio uio;
+	file_t *fp;
+	int error;
+	if ((fp = sim_getfile(fd)) == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_offset = 0;
+	uio.uio_resid = n;
+	uio.uio_rw = rw;
+	if (rw == UIO_READ)
+		error = fp->f_ops->fo_read(fp, NULL, &uio, NULL, 0);
+	else
+		error = fp->f_ops->fo_write(fp, NULL, &uio, NULL, 0);
+	if (error && uio.uio_resid != n && (error == EINTR || 
+				error == ERESTART || error == EWOULDBLOCK))
+		error = 0;
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return n - uio.uio_resid;
+}
+
+ssize_t sim_read(int fd, void *buf, size_t n)
+{
+	return sim_rw(fd, buf, n, UIO_READ);
+}
+
+ssize_t sim_write(int fd, const void *buf, size_t n)
+{
+	return sim_rw(fd, (void *)buf, n, UIO_WRITE);
+}
+
+int sim_ioctl(int fd, unsigned long cmd, void *data)
+{
+	file_t *fp;
+	int error;
+	if ((fp = sim_getfile(fd)) == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((error = fp->f_ops->fo_ioctl(fp, cmd, data)) != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int sim_close(int fd)
+{
+	file_t *fp;
+	if ((fp = sim_getfile(fd)) == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	fp->f_ops->fo_close(fp);
+	fd_abort(curproc, fp, fd);
+	return 0;
+}
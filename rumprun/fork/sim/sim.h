@@ -0,0 +1,20 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+/*
+ * sys_my_pipe.c as a Linux program. sim_attach() plays ivshmem.c on a memfd,
+ * the rest are the system calls that a unikernel would make. Every thread of
+ * the program is a process of the same unikernel.
+ */
+#include <sys/types.h>
+
+void sim_attach(size_t size, int doorbells);
+int sim_pipe(int fd[2], int flags);
+ssize_t sim_read(int fd, void *buf, size_t n);
+ssize_t sim_write(int fd, const void *buf, size_t n);
+int sim_ioctl(int fd, unsigned long cmd, void *data);
+int sim_close(int fd);
+
+extern int my_pipe_spin_max;
+
+#endif /* _SIM_H_ */
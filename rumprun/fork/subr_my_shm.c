@@ -0,0 +1,146 @@
+/*
+ * Management of the ivshmem shared memory that is used by my_pipe.
+ *
+ * The memory starts with a superblock that holds the layout version, the
+ * allocator state and a directory with the control block of every pipe. The
+ * rest of the memory is handed out in extents by a lock-free allocator. An
+ * extent has a power of 2 size (at least one cache line) and freed extents
+ * are kept in one free list per size, so they are only reused for requests of
+ * the same size class. Free lists are Treiber stacks whose heads carry a
+ * generation count next to the offset of the first extent, to avoid ABA.
+ * The allocator itself is in my_pipe_shm.h, host/libmypipe.c uses it too.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/atomic.h>
+#include <sys/bus.h>
+
+#include "my_pipe.h"
+
+/*
+ * Every kernel that attaches to the memory must see the same layout, and the
+ * fields that different VMs write must not share a cache line
+ */
+CTASSERT(offsetof(struct my_shm_sb, version) == MY_SHM_SB_VERSION);
+CTASSERT(offsetof(struct my_shm_sb, len) == MY_SHM_SB_LEN);
+CTASSERT(offsetof(struct my_shm_sb, brk) == MY_SHM_SB_BRK);
+CTASSERT(offsetof(struct my_shm_sb, fork) == MY_SHM_SB_FORK);
+CTASSERT(offsetof(struct my_shm_sb, free) == MY_SHM_SB_FREE);
+CTASSERT(offsetof(struct my_shm_sb, slots) == MY_SHM_SB_SLOTS);
+CTASSERT(sizeof(struct my_shm_sb) == MY_SHM_SB_SIZE);
+CTASSERT(MY_SHM_SB_SIZE % MY_PIPE_CACHE_LINE == 0);
+CTASSERT(MY_SHM_MIN_EXTENT % MY_PIPE_CACHE_LINE == 0);
+
+CTASSERT(offsetof(struct my_pipe_ctl, wr_lock) == 1 * MY_PIPE_CACHE_LINE);
+CTASSERT(offsetof(struct my_pipe_ctl, wr_active) < 2 * MY_PIPE_CACHE_LINE);
+CTASSERT(offsetof(struct my_pipe_ctl, rd_lock) == 2 * MY_PIPE_CACHE_LINE);
+CTASSERT(sizeof(struct my_pipe_ctl) == 3 * MY_PIPE_CACHE_LINE);
+CTASSERT(MY_PIPE_BUF_SIZE % MY_PIPE_REC_ALIGN == 0);
+
+/*
+ * The memory is mapped cacheable and, like the pipes, the superblock is used
+ * through pointers with shm_load()/shm_store() and atomics
+ */
+static inline struct my_shm_sb *shm_sb(void)
+{
+	return (struct my_shm_sb *)sharme.data_b;
+}
+
+/*
+ * Initialize the superblock if nobody did it yet. The one that manages to
+ * swap the magic number to MY_SHM_BUSY initializes it, everyone else waits
+ * until the magic number shows up.
+ */
+int my_shm_init(void)
+{
+	struct my_shm_sb *sb = shm_sb();
+	uint32_t magic;
+	magic = shm_load(sb->magic);
+	if (magic != MY_SHM_MAGIC && magic != MY_SHM_BUSY &&
+			__sync_bool_compare_and_swap(&sb->magic, magic, 
+				MY_SHM_BUSY)) {
+		memset((void *)(sharme.data_b + MY_SHM_SB_VERSION), 0,
+				MY_SHM_SB_SIZE - MY_SHM_SB_VERSION);
+		shm_store(sb->version, MY_SHM_VERSION);
+		shm_store(sb->len, sharme.data_s);
+		shm_store(sb->brk, MY_SHM_SB_SIZE);
+		/* the fields go out before the magic number */
+		shm_store_rel(sb->magic, MY_SHM_MAGIC);
+		return 0;
+	}
+	while (shm_load_acq(sb->magic) != MY_SHM_MAGIC)
+		/* do nothing */;
+	/* somebody uses the memory with another layout */
+	if (shm_load(sb->version) != MY_SHM_VERSION)
+		return EPROGMISMATCH;
+	return 0;
+}
+
+/*
+ * Allocate an extent of at least size bytes, aligned to a cache line.
+ * Returns its offset or 0 if there is not enough memory.
+ */
+bus_size_t my_shm_alloc(bus_size_t size)
+{
+	return my_shm_ext_alloc(sharme.data_b, sharme.data_s, size);
+}
+
+/*
+ * Give back an extent that my_shm_alloc returned for size bytes
+ */
+void my_shm_free(bus_size_t off, bus_size_t size)
+{
+	my_shm_ext_free(sharme.data_b, off, size);
+}
+
+/*
+ * Allocate a buffer of size bytes for MY_PIPE_BALLOC, behind its header.
+ * Returns the offset of the buffer or 0.
+ */
+bus_size_t my_shm_balloc(bus_size_t size)
+{
+	return my_shm_buf_alloc(sharme.data_b, sharme.data_s, size);
+}
+
+/*
+ * Is there a buffer of at least len bytes at off?
+ */
+int my_shm_bcheck(bus_size_t off, bus_size_t len)
+{
+	return my_shm_buf_class(sharme.data_b, sharme.data_s, off, len) < 0 ?
+		EINVAL : 0;
+}
+
+/*
+ * Give back the buffer at off by the class it was allocated with
+ */
+int my_shm_bfree(bus_size_t off)
+{
+	return my_shm_buf_free(sharme.data_b, sharme.data_s, off) < 0 ?
+		EINVAL : 0;
+}
+
+/*
+ * Publish the control block of a pipe in the directory. Returns the slot
+ * or -1 if the directory is full.
+ */
+int my_shm_slot_get(bus_size_t ctl)
+{
+	int slot;
+	for (slot = 0; slot < MY_SHM_NSLOTS; slot++) {
+		if (__sync_bool_compare_and_swap(&shm_sb()->slots[slot], 0,
+					ctl))
+			return slot;
+	}
+	return -1;
+}
+
+/*
+ * Remove a pipe from the directory
+ */
+void my_shm_slot_put(int slot)
+{
+	shm_store_rel(shm_sb()->slots[slot], 0);
+}
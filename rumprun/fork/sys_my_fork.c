@@ -4,10 +4,15 @@
 #include <sys/file.h>
 #include <sys/proc.h>
 #include <sys/bus.h>
+#include <sys/sysctl.h>
 
 #include <sys/time.h>
 #define NSEC            1000000000
 
+/* stages of the last fork, kern.my_fork.times */
+static struct my_fork_times my_fork_last;
+static uint32_t my_fork_seq;
+
 /* hypercall using io vm exit */
 static inline uint32_t inl(uint16_t port)
 {
@@ -16,22 +21,35 @@ static inline uint32_t inl(uint16_t port)
 	return rv;
 }
 
-static void increase_pipe_rw(bus_size_t n, bus_size_t lock)
+/* hypercall that passes a value to qemu */
+static inline void outl(uint16_t port, uint32_t v)
+{
+	__asm__ __volatile__("outl %0, %1" : : "a"(v), "d"(port));
+}
+
+static int64_t ts_diff(struct timespec *t1, struct timespec *t2)
+{
+	return (int64_t)(t2->tv_sec - t1->tv_sec) * NSEC + t2->tv_nsec - 
+		t1->tv_nsec;
+}
+
+static void add_pipe_rw(uint8_t *n, uint8_t *lock, int d)
 {
 	uint8_t a;
 	pipe_lock(lock);
-	a = bus_space_read_1(sharme.data_t, sharme.data_h, n);
-	a++;
-	printf(" increase: %d\n", a);
-	bus_space_write_1(sharme.data_t, sharme.data_h, n, a);
+	a = *n;
+	a += d;
+	shm_store(*n, a);
 	pipe_unlock(lock);
 }
 
-int sys_my_fork(struct lwp *l, const void *v, register_t *retval)
+/*
+ * Add d to the readers and writers of every pipe we have open, for the child
+ * that inherits them or, with -1, for a child that did not come. Returns 1 if
+ * there are pipes.
+ */
+static int fork_pipes(struct lwp *l, int d)
 {
-	/* check for opened pipes */
-	//struct timespec tol1, tol2, t1, t2;
-	//nanotime(&tol1);
 	fdfile_t *ff;
 	file_t *fp;
 	fdtab_t *dt;
@@ -49,53 +67,99 @@ int sys_my_fork(struct lwp *l, const void *v, register_t *retval)
 			flag = 1;
 			struct my_pipe_op *pipe_op = fp->f_data;
 			if (pipe_op->oper == 0)
-				/* increase readers by one */
-				increase_pipe_rw(pipe_op->pipe->nreaders, 
-						pipe_op->pipe->lock);
+				/* change readers by d */
+				add_pipe_rw(&pipe_op->pipe->ctl->nreaders, 
+						&pipe_op->pipe->ctl->lock, d);
 			else if (pipe_op->oper == 1)
-				/* increase writers by one */
-				increase_pipe_rw(pipe_op->pipe->nwriters, 
-						pipe_op->pipe->lock);
+				/* change writers by d */
+				add_pipe_rw(&pipe_op->pipe->ctl->nwriters, 
+						&pipe_op->pipe->ctl->lock, d);
 		}
 	}
+	return flag;
+}
 
-	/* start migration */
-	unsigned int ret; 
-	//nanotime(&t1);
-	ret = inl(0xffdd);
-	//nanotime(&t2);
-	//printf("KERNEL: start migration hypercall: %ldns\n", (t2.tv_sec - t1.tv_sec) * NSEC + t2.tv_nsec - t1.tv_nsec);
-	/* wait until migration is over */
-	//nanotime(&t1);
-	ret = inl(0xffdb);
-	while (ret == 0) {
-		ret = inl(0xffdb);
-	}
-	//nanotime(&t2);
-	//printf("KERNEL: wait migration: %ldns\n", (t2.tv_sec - t1.tv_sec) * NSEC + t2.tv_nsec - t1.tv_nsec);
-	/* when migration is finished child will get 2, 
-	 * while parent will get 1
+int sys_my_fork(struct lwp *l, const void *v, register_t *retval)
+{
+	/* check for opened pipes */
+	struct my_fork_times ft;
+	struct timespec tol1, t1, t2;
+	nanotime(&tol1);
+	memset(&ft, 0, sizeof(ft));
+	struct my_shm_sb *sb = (struct my_shm_sb *)sharme.data_b;
+	/* the child shares our pipes */
+	int flag = fork_pipes(l, 1);
+
+	/* tell qemu which fork this is, it logs its stages under the same id */
+	ft.id = ++my_fork_seq;
+	outl(0xffda, ft.id);
+	/* fork, qemu keeps us in the hypercall until the snapshot is taken and
+	 * the qemu of the child is up. The parent gets the process id of the
+	 * new qemu, the child starts from the snapshot with 0.
 	 */
-	if (ret == 1) {
-		/* parent return process id of new qeemu instance */
-		//nanotime(&t1);
-		*retval = inl(0xffdc);
-		//nanotime(&t2);
-		//printf("KERNEL: create vm: %ldns\n", (t2.tv_sec - t1.tv_sec) * NSEC + t2.tv_nsec - t1.tv_nsec);
+	uint32_t ret; 
+	nanotime(&t1);
+	ret = inl(0xffdc);
+	nanotime(&t2);
+	ft.hypercall = ts_diff(&t1, &t2);
+	if (ret == (uint32_t)-1) {
+		/* no child, take its ends of the pipes back */
+		fork_pipes(l, -1);
+		return EAGAIN;
+	}
+	if (ret != 0) {
+		/* parent */
+		*retval = ret;
 		if (flag == 1) {
-			while( bus_space_read_1(sharme.data_t, sharme.data_h, 
-						sharme.data_s - 1) != 77)
+			t1 = t2;
+			while (shm_load_acq(sb->fork) != 77)
 				/* wait for the child to start */;
+			/* ready for the next fork */
+			shm_store(sb->fork, 0);
+			nanotime(&t2);
+			ft.handshake = ts_diff(&t1, &t2);
 		}
 	} else  {
 		/* child return 0 */
 		*retval = 0;
-		if (flag == 1) {
-			bus_space_write_1(sharme.data_t, sharme.data_h, 
-					sharme.data_s - 1, 77);
-		}
+		ft.child = 1;
+		/* a qemu from the zygote pool does not know which fork it
+		 * came from */
+		outl(0xffda, ft.id);
+		/* the child is a new ivshmem peer, so it got a new id */
+		if (sharme.peer >= 0)
+			sharme.peer = (int32_t)bus_space_read_4(sharme.reg_t, 
+					sharme.reg_h, IVSHMEM_IVPOSITION);
+		/* the waiter slots of our pollers belong to the parent */
+		my_pipe_forked();
+		if (flag == 1)
+			shm_store_rel(sb->fork, 77);
 	}
-	//nanotime(&tol2);
-	//printf("KERNEL: fork system call: %ldns\n", (tol2.tv_sec - tol1.tv_sec) * NSEC + tol2.tv_nsec - tol1.tv_nsec);
+	/* the clock of the child went on in the parent for a while, so its
+	 * numbers are only rough */
+	nanotime(&t2);
+	ft.total = ts_diff(&tol1, &t2);
+	my_fork_last = ft;
 	return 0;
 }
+
+/*
+ * kern.my_fork.times, the stages of the last fork
+ */
+SYSCTL_SETUP(sysctl_kern_my_fork_setup, "sysctl kern.my_fork subtree setup")
+{
+	const struct sysctlnode *node = NULL;
+
+	sysctl_createv(clog, 0, NULL, &node,
+			CTLFLAG_PERMANENT,
+			CTLTYPE_NODE, "my_fork",
+			SYSCTL_DESCR("fork of unikernels"),
+			NULL, 0, NULL, 0,
+			CTL_KERN, CTL_CREATE, CTL_EOL);
+	sysctl_createv(clog, 0, &node, NULL,
+			CTLFLAG_PERMANENT|CTLFLAG_READONLY,
+			CTLTYPE_STRUCT, "times",
+			SYSCTL_DESCR("Stages of the last fork in ns"),
+			NULL, 0, &my_fork_last, sizeof(my_fork_last),
+			CTL_CREATE, CTL_EOL);
+}
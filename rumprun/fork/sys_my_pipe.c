@@ -3,6 +3,14 @@
 #include <sys/file.h>
 #include <sys/proc.h>
 #include <sys/malloc.h>
+#include <sys/atomic.h>
+#include <sys/sysctl.h>
+#include <sys/poll.h>
+#include <sys/event.h>
+#include <sys/callout.h>
+#include <sys/kernel.h>
+#include <sys/intr.h>
+#include <sys/filio.h>
 #include <sys/bus.h> /* structs, prototypes for pci bus stuff and DEVMETHOD macros! */
 
 
@@ -13,13 +21,83 @@ int my_pipe_read(file_t *fp, off_t *offset, struct uio *uio, kauth_cred_t cred,
 		int flags);
 int my_pipe_write(file_t *fp, off_t *offset, struct uio *uio, kauth_cred_t cred,
 		int flags);
+int my_pipe_ioctl(file_t *fp, u_long cmd, void *data);
+int my_pipe_poll(file_t *fp, int events);
+int my_pipe_kqfilter(file_t *fp, struct knote *kn);
+static int pipe_can_read(struct my_pipe *pipe, uint32_t need);
+static int pipe_can_write(struct my_pipe *pipe, uint32_t need);
+static int pipe_wait(struct my_pipe_op *op, uint32_t *waiters,
+		int (*ready)(struct my_pipe *, uint32_t), uint32_t need);
+static void pipe_wakeup(uint32_t *waiters);
+static int pipe_resize(struct my_pipe *pipe, int *size);
+static void pipe_publish(struct my_pipe_ctl *ctl, uint32_t idx, uint32_t n);
+static int pipe_write(file_t *fp, struct uio *uio, uint32_t type);
+static uint32_t pipe_rec_type(struct my_pipe_ctl *ctl);
+static int pipe_nread(struct my_pipe_ctl *ctl);
+static int pipe_read_rec(struct my_pipe_ctl *ctl, struct uio *uio);
+static int pipe_wait_rec(file_t *fp);
+static int pipe_readv(file_t *fp, struct my_pipe_readv *rv);
+static int pipe_bsend(file_t *fp, struct my_pipe_buf *b);
+static int pipe_brecv(file_t *fp, struct my_pipe_buf *b);
+static int pipe_bvalid(struct my_pipe_buf *b);
+static void pipe_bdrain(struct my_pipe_ctl *ctl);
+static int pipe_setpkt(struct my_pipe *pipe, int on);
+static void pipe_quiesce(struct my_pipe_ctl *ctl);
+static void pipe_unquiesce(struct my_pipe_ctl *ctl);
+static void pipe_selclaim(struct my_pipe *pipe, int side);
+static void pipe_selrelease(struct my_pipe *pipe, int side);
+static int pipe_selbusy(struct my_pipe *pipe, int side);
+static void pipe_selwakeup(void *arg);
+static void pipe_seltick(void *arg);
+static void filt_my_pipedetach(struct knote *kn);
+static int filt_my_piperead(struct knote *kn, long hint);
+static int filt_my_pipewrite(struct knote *kn, long hint);
 
 const struct fileops my_pipeops = {
 	.fo_read = my_pipe_read,
 	.fo_write = my_pipe_write,
+	.fo_ioctl = my_pipe_ioctl,
+	.fo_poll = my_pipe_poll,
 	.fo_close = my_pipe_close,
+	.fo_kqfilter = my_pipe_kqfilter,
 };
 
+static const struct filterops my_pipe_rfiltops = {
+	.f_isfd = 1,
+	.f_attach = NULL,
+	.f_detach = filt_my_pipedetach,
+	.f_event = filt_my_piperead,
+};
+
+static const struct filterops my_pipe_wfiltops = {
+	.f_isfd = 1,
+	.f_attach = NULL,
+	.f_detach = filt_my_pipedetach,
+	.f_event = filt_my_pipewrite,
+};
+
+/* default spin budget of pipes (kern.my_pipe.spin_max) */
+int my_pipe_spin_max = MY_PIPE_SPIN_MAX;
+
+/*
+ * The pipes of this kernel, so that a doorbell can notify their pollers.
+ * my_pipes_lock also protects the selinfo and the sel_* fields of the pipes.
+ */
+static LIST_HEAD(, my_pipe) my_pipes = LIST_HEAD_INITIALIZER(my_pipes);
+static kmutex_t my_pipes_lock;
+static void *my_pipe_si;		/* notifies the pollers */
+static callout_t my_pipe_ch;		/* looks at the pipes every tick */
+static int my_pipe_sel_polling;		/* pollers without a waiter slot */
+static int my_pipe_sel_claims;		/* sides with a claim of pollers */
+
+/* ticks after its last poll(2) that a side keeps its claim */
+#define	MY_PIPE_SEL_IDLE	(hz > 1 ? hz : 1)
+
+static inline void pipe_pause(void)
+{
+	__asm__ __volatile__("pause");
+}
+
 /*
  * Handle the close request 
  */
@@ -27,32 +105,46 @@ int my_pipe_close(file_t *fp)
 {
 	struct my_pipe_op *op = fp->f_data; 
 	struct my_pipe *pipe = op->pipe; 
-	uint8_t nparts[2];
+	struct my_pipe_ctl *ctl = pipe->ctl;
+	uint8_t nreaders, nwriters;
 	fp->f_data = NULL;
 	/* decrease number of writers or readers in pipe */
-	pipe_lock(pipe->lock);
-	read_region_1(pipe->nreaders, nparts, 2);
+	pipe_lock(&ctl->lock);
+	nreaders = ctl->nreaders;
+	nwriters = ctl->nwriters;
 	if (op->oper == 0) 
-		nparts[0]--;
+		shm_store_rel(ctl->nreaders, --nreaders);
 	else if (op->oper == 1)
-		nparts[1]--;
-	write_region_1(pipe->nreaders, nparts, 2);
-	pipe_unlock(pipe->lock);
-	/* clean used shared memory if no readers or writers exist */
-	if (nparts[0] == 0 && nparts[1] == 0) {
-		memset((void *)sharme.data_b, 0, 20 + MY_PIPE_BUF_SIZE);
-		printf("clear all\n");
-		bus_space_write_1(sharme.data_t, sharme.data_h,
-				sharme.data_s - 1, 0);
-	}
+		shm_store_rel(ctl->nwriters, --nwriters);
+	pipe_unlock(&ctl->lock);
 	/* decrease number of writers or readers in pipe from current process */
 	if (op->oper == 0) 
 		pipe->pr_readers--;
 	else if(op->oper == 1)
 		pipe->pr_writers--;
-	/* free my_pipe struct if no readers and writers exist */
+	/* the last end of this side in our kernel takes its pollers along */
+	mutex_enter(&my_pipes_lock);
+	if ((op->oper == 0 ? pipe->pr_readers : pipe->pr_writers) == 0)
+		pipe_selrelease(pipe, op->oper);
 	if (pipe->pr_readers == 0 && pipe->pr_writers == 0) 
+		LIST_REMOVE(pipe, list);
+	mutex_exit(&my_pipes_lock);
+	/* whoever sleeps on the pipe has to notice that we left */
+	pipe_wakeup(ctl->rd_waiters);
+	pipe_wakeup(ctl->wr_waiters);
+	/* give back the shared memory if no readers or writers exist */
+	if (nreaders == 0 && nwriters == 0) {
+		my_shm_slot_put(pipe->slot);
+		pipe_bdrain(ctl);
+		my_shm_free(ctl->buf, ctl->len);
+		my_shm_free(pipe->ctl_off, MY_PIPE_CTL_SIZE);
+	}
+	/* free my_pipe struct if no readers and writers exist */
+	if (pipe->pr_readers == 0 && pipe->pr_writers == 0) {
+		seldestroy(&pipe->sel[0]);
+		seldestroy(&pipe->sel[1]);
 		free(pipe, M_TEMP);
+	}
 	/* free my_pipe_op struct of process */
 	free(op, M_TEMP);
 	/* this always succeeds */
@@ -67,74 +159,76 @@ int my_pipe_read(file_t *fp, off_t *offset, struct uio *uio, kauth_cred_t cred,
 {
 	struct my_pipe_op *op = fp->f_data; 
 	struct my_pipe *pipe = op->pipe; 
+	struct my_pipe_ctl *ctl = pipe->ctl;
 	int ret = 0;
 	size_t nread = 0, size;
-	uint8_t nwriters;
-	uint32_t bigs[4], cnt, len, in, out;
+	uint32_t len, head, tail, cnt;
+	uint8_t *buf;
+	/* only one reader at a time consumes from the pipe, the writers never
+	 * take this lock */
+	pipe_lock(&ctl->rd_lock);
 	/* keep trying until userspace gets as many bytes as it asked or until
 	 * pipe gets empty*/
 	while (uio->uio_resid) {
-		/* wait until something is written in pipe, without acquiring
+		/* the buffer may have been resized while we did not hold
 		 * the lock */
-		cnt = bus_space_read_4(sharme.data_t, sharme.data_h, 
-				pipe->cnt);
-		while (cnt == 0) {
-			/* if no writers exist then return EOF or the bytes
-			 * that have been read until now */
-			if (bus_space_read_1(sharme.data_t, sharme.data_h,
-						pipe->nwriters) == 0) 
-				break;
-			cnt = bus_space_read_4(sharme.data_t, sharme.data_h, 
-					pipe->cnt);
-		}
-		pipe_lock(pipe->lock);
-		read_region_4(pipe->len, bigs, 4);
-		len = bigs[0];
-		in = bigs[1];
-		out = bigs[2];
-		cnt = bigs[3];
-		printf("READ1: len=%d, cnt=%d, in=%d, out=%d\n", len, cnt, in, out);
-		/* check with the lock if any data is available */
-		if (cnt > 0) {
-			/* determine the number of bytes that will be read */
-			size = len - out;
-			if (size > cnt)
-				size = cnt;
-			if (size > uio->uio_resid)
-				size = uio->uio_resid;
-			ret = uiomove((void *) (sharme.data_b + pipe->buf + out)
-					, size, uio);
-			if (ret) {
-				pipe_unlock(pipe->lock);
+		len = ctl->len;
+		buf = sharme.data_b + ctl->buf;
+		tail = ctl->tail;
+		/* the data is read only after we have seen the new head */
+		head = shm_load_acq(ctl->head);
+		if (head == tail) {
+			/* return the bytes that have been read until now or
+			 * EOF if all the writers left */
+			if (nread > 0)
 				break;
+			if (shm_load_acq(ctl->nwriters) == 0) {
+				/* the last writer may have published
+				 * just before it left */
+				if (shm_load_acq(ctl->head) == tail)
+					break;
+				continue;
 			}
-			/* update out pointer and number of bytes in pipe */
-			out += size;
-			if (out >= len)
-				out = 0;
-			cnt -= size;
-			/* if all data has been read then start using the 
-			 * pipe buffer from the beginning */
-			if (cnt == 0) {
-				in = 0;
-				out = 0;
+			if (fp->f_flag & FNONBLOCK) {
+				ret = EAGAIN;
+				break;
 			}
-			nread += size;
-			bigs[1] = in;
-			bigs[2] = out;
-			bigs[3] = cnt;
-			printf("READ2: len=%d, cnt=%d, in=%d, out=%d\n", len, cnt, in, out);
-			write_region_4(pipe->len, bigs, 4);
+			/* wait until something is written in pipe */
+			pipe_unlock(&ctl->rd_lock);
+			ret = pipe_wait(op, ctl->rd_waiters, pipe_can_read, 1);
+			pipe_lock(&ctl->rd_lock);
+			if (ret)
+				break;
+			continue;
 		}
-		nwriters = bus_space_read_1(sharme.data_t, sharme.data_h, 
-				pipe->nwriters);
-		pipe_unlock(pipe->lock);
-		/* if no data is available then return what has been read */
-		if (nread > 0 && cnt == 0) 
+		/* in packet mode every read gets one record. A buffer is
+		 * left for BRECV, read(2) would lose it. */
+		if (shm_load(ctl->flags) & MY_PIPE_F_PACKET) {
+			if (pipe_rec_type(ctl) == MY_PIPE_REC_BUF)
+				ret = ENOMSG;
+			else
+				ret = pipe_read_rec(ctl, uio);
+			if (ret == 0)
+				pipe_wakeup(ctl->wr_waiters);
 			break;
-		if (nwriters == 0) 
+		}
+		cnt = head - tail;
+		/* determine the number of bytes that will be read, without
+		 * crossing the end of the buffer */
+		size = len - (tail & (len - 1));
+		if (size > cnt)
+			size = cnt;
+		if (size > uio->uio_resid)
+			size = uio->uio_resid;
+		ret = uiomove(buf + (tail & (len - 1)), size, uio);
+		if (ret)
 			break;
+		/* give the space back to the writer after the copy is done */
+		shm_store_rel(ctl->tail, tail + size);
+		pipe_wakeup(ctl->wr_waiters);
+		nread += size;
 	}
+	pipe_unlock(&ctl->rd_lock);
 	return ret;
 }
 
@@ -143,152 +237,1015 @@ int my_pipe_read(file_t *fp, off_t *offset, struct uio *uio, kauth_cred_t cred,
  */
 int my_pipe_write(file_t *fp, off_t *offset, struct uio *uio, kauth_cred_t cred,
 	       	int flags)
+{
+	return pipe_write(fp, uio, MY_PIPE_REC_DATA);
+}
+
+/*
+ * Write uio to the pipe. In packet mode it becomes one record of the given
+ * type, other types than MY_PIPE_REC_DATA need packet mode.
+ */
+static int pipe_write(file_t *fp, struct uio *uio, uint32_t type)
 {
 	struct my_pipe_op *op = fp->f_data; 
 	struct my_pipe *pipe = op->pipe; 
+	struct my_pipe_ctl *ctl = pipe->ctl;
 	int ret = 0;
-	size_t space;
-	int size;
-	uint8_t nreaders;
-	uint32_t bigs[4], len, cnt, in;
-	//read_region_4(pipe->len, bigs, 4);
-	len = bus_space_read_4(sharme.data_t, sharme.data_h, pipe->len);
-	cnt = bus_space_read_4(sharme.data_t, sharme.data_h, pipe->cnt);
-	//len = bigs[0];
-	//in = bigs[1];
-	//out = bigs[2];
-	//cnt = bigs[3];
-	//printf("WRITE1: len=%d, cnt=%d, in =%d\n", len, cnt, in);
-	/* get the lock for writing (atomic write) */
-	pipe_lock(pipe->wr_lock);
+	size_t need, want;
+	uint32_t len, idx, n, off, size, hdr, cnt;
+	uint8_t *buf;
+	/* writes up to PIPE_BUF bytes are never mixed with other writes, so
+	 * wait until all of them fit */
+	need = uio->uio_resid <= PIPE_BUF ? uio->uio_resid : 1;
 	/* keep trying until all bytes are written in pipe, or until all the 
 	 * readers leave */
 	while (uio->uio_resid) {
-		//space = len - cnt;
-		/* wait for space, without acquiring the lock */
-		do {
-			/* if no readers exist then EPIPE must be returned */
-			nreaders = bus_space_read_1(sharme.data_t, 
-					sharme.data_h, 	pipe->nreaders);
-			if (nreaders == 0)
+		/* if no readers exist return EPIPE */
+		if (shm_load(ctl->nreaders) == 0) {
+			ret = EPIPE;
+			break;
+		}
+		/* reserve our space, other writers may fill theirs at the
+		 * same time */
+		my_pipe_wr_enter(ctl);
+		want = uio->uio_resid < UINT32_MAX ? uio->uio_resid : UINT32_MAX;
+		/* nobody resizes the buffer or changes the mode while we are
+		 * active */
+		len = shm_load(ctl->len);
+		hdr = 0;
+		if (shm_load(ctl->flags) & MY_PIPE_F_PACKET) {
+			/* a record goes in whole or not at all */
+			if (uio->uio_resid > len - MY_PIPE_REC_HDR) {
+				my_pipe_wr_exit(ctl);
+				ret = EMSGSIZE;
 				break;
-			cnt = bus_space_read_4(sharme.data_t, sharme.data_h,
-					pipe->cnt);
-			space = len - cnt;
-		} while (space == 0);
-		pipe_lock(pipe->lock);
-		read_region_4(pipe->len, bigs, 4);
-		len = bigs[0];
-		in = bigs[1];
-		printf("WRITE2: len=%d, cnt=%d, in =%d\n", len, cnt, in);
-		//out = bigs[2];
-		cnt = bigs[3];
-		/* check for space with the lock */
-		space = len - cnt;
-		if (space > 0 && nreaders != 0) {
-			/* determine tha number of bytes tha will be written */
-			if (space > uio->uio_resid)
-				size = uio->uio_resid;
-			else 
-				size = space;
-			if (size > (len - in))
-				size = len - in;
-			ret = uiomove((void *) (sharme.data_b + pipe->buf + in),
-					size, uio);
-			if(ret) {
-				pipe_unlock(pipe->lock);
+			}
+			hdr = MY_PIPE_REC_HDR;
+			need = want = MY_PIPE_REC_SIZE(uio->uio_resid);
+		} else if (type != MY_PIPE_REC_DATA) {
+			my_pipe_wr_exit(ctl);
+			ret = EINVAL;
+			break;
+		}
+		n = my_pipe_reserve(ctl, need, want, 0, &idx);
+		if (n == 0) {
+			my_pipe_wr_exit(ctl);
+			/* a non blocking write of up to PIPE_BUF bytes writes
+			 * all or nothing, a bigger one as much as fits. If
+			 * some bytes were written the caller gets their
+			 * number instead of the error. */
+			if (fp->f_flag & FNONBLOCK) {
+				ret = EAGAIN;
 				break;
 			}
-			/* update in pointer and number of bytes in pipe */
-			in += size;
-			/* circular writing in buffer */
-			if (in >= len)
-				in = 0;
-			cnt += size;
-			bigs[1] = in;
-			bigs[3] = cnt;
-			printf("WRITE3: len=%d, cnt=%d, in =%d\n", len, cnt, in);
-			write_region_4(pipe->len, bigs, 4);
+			/* wait for space or until all the readers leave */
+			ret = pipe_wait(op, ctl->wr_waiters, pipe_can_write, 
+					need);
+			if (ret)
+				break;
+			continue;
 		}
-		nreaders = bus_space_read_1(sharme.data_t, sharme.data_h, 
-				pipe->nreaders);
-		pipe_unlock(pipe->lock);
-		/* if no readers exist return EPIPE */
-		if (nreaders == 0) {
-			ret = EPIPE;
+		buf = sharme.data_b + shm_load(ctl->buf);
+		cnt = n;
+		if (hdr) {
+			/* the header never wraps, the data may */
+			cnt = uio->uio_resid;
+			my_pipe_rec_put(buf, len, idx, cnt, type);
+		}
+		off = (idx + hdr) & (len - 1);
+		size = len - off;
+		if (size > cnt)
+			size = cnt;
+		ret = uiomove(buf + off, size, uio);
+		if (ret == 0 && size < cnt)
+			ret = uiomove(buf, cnt - size, uio);
+		if (ret) {
+			/* the space is reserved anyway, let the reader get
+			 * zeroes instead of stale bytes */
+			memset(buf + off, 0, size);
+			memset(buf, 0, cnt - size);
+		}
+		pipe_publish(ctl, idx, n);
+		my_pipe_wr_exit(ctl);
+		pipe_wakeup(ctl->rd_waiters);
+		if (ret)
+			break;
+		/* the rest of a small write fits in the space we saw */
+		need = 1;
+	}
+	return ret;
+}
+
+/*
+ * Publish the n bytes reserved at idx, after the writers that reserved
+ * before us published theirs
+ */
+static void pipe_publish(struct my_pipe_ctl *ctl, uint32_t idx, uint32_t n)
+{
+	int cnt;
+	for (cnt = 0; !my_pipe_can_publish(ctl, idx); cnt++) {
+		/* an earlier writer may sit in a VM that does not run */
+		if (cnt < my_pipe_spin_max)
+			pipe_pause();
+		else
+			kpause("mypipe", false, 1, NULL);
+	}
+	shm_store_rel(ctl->head, idx + n);
+}
+
+/*
+ * Type of the record at the tail of a pipe in packet mode. Called with
+ * rd_lock held and a record in the pipe.
+ */
+static uint32_t pipe_rec_type(struct my_pipe_ctl *ctl)
+{
+	return my_pipe_rec_type(sharme.data_b + ctl->buf, ctl->len, ctl->tail);
+}
+
+/*
+ * Bytes the next read gets without waiting for FIONREAD: in packet mode the
+ * length of the next record, else all the bytes in the pipe
+ */
+static int pipe_nread(struct my_pipe_ctl *ctl)
+{
+	uint32_t n;
+	pipe_lock(&ctl->rd_lock);
+	n = shm_load_acq(ctl->head) - ctl->tail;
+	if (n != 0 && (shm_load(ctl->flags) & MY_PIPE_F_PACKET))
+		n = my_pipe_rec_len(sharme.data_b + ctl->buf, ctl->len,
+				ctl->tail);
+	pipe_unlock(&ctl->rd_lock);
+	return n;
+}
+
+/*
+ * Copy the record at the tail of the pipe to uio and consume it. What does
+ * not fit in uio is thrown away. Called with rd_lock held, after the caller
+ * saw a head past the tail.
+ */
+static int pipe_read_rec(struct my_pipe_ctl *ctl, struct uio *uio)
+{
+	uint32_t len, tail, rec, cnt, off, size;
+	uint8_t *buf;
+	int ret;
+	len = ctl->len;
+	buf = sharme.data_b + ctl->buf;
+	tail = ctl->tail;
+	rec = my_pipe_rec_len(buf, len, tail);
+	/* whoever has the shared memory can write a bad header */
+	if (!my_pipe_rec_ok(len, tail, shm_load_acq(ctl->head), rec))
+		return EBADMSG;
+	cnt = rec;
+	if (cnt > uio->uio_resid)
+		cnt = uio->uio_resid;
+	off = (tail + MY_PIPE_REC_HDR) & (len - 1);
+	size = len - off;
+	if (size > cnt)
+		size = cnt;
+	ret = uiomove(buf + off, size, uio);
+	if (ret == 0 && size < cnt)
+		ret = uiomove(buf, cnt - size, uio);
+	/* keep the record if the copy failed */
+	if (ret == 0)
+		shm_store_rel(ctl->tail, tail + MY_PIPE_REC_SIZE(rec));
+	return ret;
+}
+
+/*
+ * Wait until there is a record in a pipe in packet mode, or until all the
+ * writers left. Called with rd_lock held.
+ */
+static int pipe_wait_rec(file_t *fp)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe_ctl *ctl = op->pipe->ctl;
+	int ret;
+	for (;;) {
+		/* packet mode may have been turned off while we slept */
+		if (!(shm_load(ctl->flags) & MY_PIPE_F_PACKET))
+			return EINVAL;
+		if (shm_load_acq(ctl->head) != ctl->tail)
+			return 0;
+		/* the last writer may have published just before it left,
+		 * the callers load head again after this and find either
+		 * its record or EOF */
+		if (shm_load_acq(ctl->nwriters) == 0)
+			return 0;
+		if (fp->f_flag & FNONBLOCK)
+			return EAGAIN;
+		pipe_unlock(&ctl->rd_lock);
+		ret = pipe_wait(op, ctl->rd_waiters, pipe_can_read, 1);
+		pipe_lock(&ctl->rd_lock);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * Read up to rv->iovcnt records, one per iovec, taking the read lock and
+ * waking the writers only once. Waits for the first record only.
+ */
+static int pipe_readv(file_t *fp, struct my_pipe_readv *rv)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe_ctl *ctl = op->pipe->ctl;
+	struct iovec aiov;
+	struct uio auio;
+	int ret = 0;
+	if (op->oper != 0)
+		return EBADF;
+	if (rv->iovcnt <= 0 || rv->iovcnt > UIO_MAXIOV)
+		return EINVAL;
+	rv->nrec = 0;
+	pipe_lock(&ctl->rd_lock);
+	ret = pipe_wait_rec(fp);
+	/* only the first record is waited for */
+	while (ret == 0 && rv->nrec < rv->iovcnt &&
+			shm_load_acq(ctl->head) != ctl->tail) {
+		/* stop at a buffer, as read(2) does */
+		if (pipe_rec_type(ctl) == MY_PIPE_REC_BUF) {
+			ret = ENOMSG;
 			break;
 		}
+		ret = copyin(&rv->iov[rv->nrec], &aiov, sizeof(aiov));
+		if (ret)
+			break;
+		auio.uio_iov = &aiov;
+		auio.uio_iovcnt = 1;
+		auio.uio_offset = 0;
+		auio.uio_resid = aiov.iov_len;
+		auio.uio_rw = UIO_READ;
+		auio.uio_vmspace = curproc->p_vmspace;
+		ret = pipe_read_rec(ctl, &auio);
+		if (ret)
+			break;
+		/* tell userspace how much of the iovec was used */
+		aiov.iov_len -= auio.uio_resid;
+		ret = copyout(&aiov.iov_len, &rv->iov[rv->nrec].iov_len,
+				sizeof(aiov.iov_len));
+		rv->nrec++;
+		if (ret)
+			break;
+	}
+	pipe_unlock(&ctl->rd_lock);
+	if (rv->nrec > 0) {
+		pipe_wakeup(ctl->wr_waiters);
+		/* the records are gone, so they have to be reported */
+		ret = 0;
 	}
-	pipe_unlock(pipe->wr_lock);
 	return ret;
 }
 
 /*
- * Handle the system call
+ * Pass a buffer to the read end as a MY_PIPE_REC_BUF record
  */
-int sys_my_pipe(struct lwp *l, const struct sys_my_pipe_args *uap, 
-		register_t *retval)
+static int pipe_bsend(file_t *fp, struct my_pipe_buf *b)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe_desc desc;
+	struct iovec aiov;
+	struct uio auio;
+	int ret;
+	if (op->oper != 1)
+		return EBADF;
+	if ((ret = pipe_bvalid(b)) != 0)
+		return ret;
+	desc.off = b->off;
+	desc.len = b->len;
+	aiov.iov_base = &desc;
+	aiov.iov_len = sizeof(desc);
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = 0;
+	auio.uio_resid = sizeof(desc);
+	auio.uio_rw = UIO_WRITE;
+	UIO_SETUP_SYSSPACE(&auio);
+	/* a record goes in whole or not at all */
+	return pipe_write(fp, &auio, MY_PIPE_REC_BUF);
+}
+
+/*
+ * Take the buffer of the next record out of the pipe. The record must be a
+ * MY_PIPE_REC_BUF one, else ENOMSG and it is left for read(2).
+ */
+static int pipe_brecv(file_t *fp, struct my_pipe_buf *b)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe_ctl *ctl = op->pipe->ctl;
+	struct my_pipe_desc desc;
+	struct iovec aiov;
+	struct uio auio;
+	uint32_t tail;
+	int ret;
+	if (op->oper != 0)
+		return EBADF;
+	memset(b, 0, sizeof(*b));
+	pipe_lock(&ctl->rd_lock);
+	ret = pipe_wait_rec(fp);
+	tail = ctl->tail;
+	/* EOF leaves an empty buffer */
+	if (ret || shm_load_acq(ctl->head) == tail) {
+		pipe_unlock(&ctl->rd_lock);
+		return ret;
+	}
+	if (pipe_rec_type(ctl) != MY_PIPE_REC_BUF) {
+		pipe_unlock(&ctl->rd_lock);
+		return ENOMSG;
+	}
+	aiov.iov_base = &desc;
+	aiov.iov_len = sizeof(desc);
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = 0;
+	auio.uio_resid = sizeof(desc);
+	auio.uio_rw = UIO_READ;
+	UIO_SETUP_SYSSPACE(&auio);
+	ret = pipe_read_rec(ctl, &auio);
+	pipe_unlock(&ctl->rd_lock);
+	if (ret)
+		return ret;
+	pipe_wakeup(ctl->wr_waiters);
+	/* the record was written by whoever has the shared memory */
+	if (my_shm_bcheck(desc.off, desc.len) != 0 || desc.len == 0)
+		return EBADMSG;
+	b->off = desc.off;
+	b->len = desc.len;
+	b->addr = sharme.data_b + desc.off;
+	return 0;
+}
+
+/*
+ * Is b a buffer that MY_PIPE_BALLOC returned, with len bytes at most?
+ */
+static int pipe_bvalid(struct my_pipe_buf *b)
+{
+	if (b->len == 0)
+		return EINVAL;
+	return my_shm_bcheck(b->off, b->len);
+}
+
+/*
+ * Free the buffers that are still in a pipe that nobody uses any more
+ */
+static void pipe_bdrain(struct my_pipe_ctl *ctl)
+{
+	my_pipe_bdrain(sharme.data_b, sharme.data_s, ctl);
+}
+
+/*
+ * Turn packet mode on or off. Byte and record streams cannot be mixed, so
+ * this only works while the pipe is empty. A byte stream may have left the
+ * indices anywhere, records must start at a multiple of MY_PIPE_REC_ALIGN.
+ */
+static int pipe_setpkt(struct my_pipe *pipe, int on)
+{
+	struct my_pipe_ctl *ctl = pipe->ctl;
+	uint32_t idx;
+	int ret = 0;
+	pipe_quiesce(ctl);
+	if (ctl->head != ctl->tail) {
+		ret = EBUSY;
+		goto out;
+	}
+	/* nobody writes, so prod_head == head */
+	idx = (ctl->head + MY_PIPE_REC_ALIGN - 1) & ~(MY_PIPE_REC_ALIGN - 1);
+	shm_store(ctl->prod_head, idx);
+	shm_store(ctl->head, idx);
+	shm_store(ctl->tail, idx);
+	if (on)
+		shm_store(ctl->flags, ctl->flags | MY_PIPE_F_PACKET);
+	else
+		shm_store(ctl->flags, ctl->flags & ~MY_PIPE_F_PACKET);
+out:
+	pipe_unquiesce(ctl);
+	return ret;
+}
+
+/*
+ * Handle ioctl for my_pipe
+ */
+int my_pipe_ioctl(file_t *fp, u_long cmd, void *data)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe *pipe = op->pipe; 
+	struct my_pipe_map *map;
+	struct my_pipe_buf *b;
+	int ret = 0;
+	int *val = data;
+	switch (cmd) {
+		case MY_PIPE_SETSPIN:
+			if (*val < -1) {
+				ret = EINVAL;
+				break;
+			}
+			pipe->spin_max = *val;
+			break;
+		case MY_PIPE_GETSPIN:
+			if (pipe->spin_max < 0)
+				*val = my_pipe_spin_max;
+			else
+				*val = pipe->spin_max;
+			break;
+		case MY_PIPE_SETSZ:
+			ret = pipe_resize(pipe, val);
+			break;
+		case MY_PIPE_GETSZ:
+			*val = shm_load(pipe->ctl->len);
+			break;
+		case MY_PIPE_MAP:
+			map = data;
+			map->shm = sharme.data_b;
+			map->ctl = pipe->ctl;
+			map->oper = op->oper;
+			break;
+		case MY_PIPE_WAIT:
+			if (*val < 0 || (uint32_t)*val > 
+					shm_load(pipe->ctl->len)) {
+				ret = EINVAL;
+				break;
+			}
+			if (op->oper == 0)
+				ret = pipe_wait(op, pipe->ctl->rd_waiters, 
+						pipe_can_read, *val);
+			else
+				ret = pipe_wait(op, pipe->ctl->wr_waiters, 
+						pipe_can_write, *val);
+			break;
+		case FIONBIO:
+			/* f_flag already has FNONBLOCK */
+			break;
+		case FIOASYNC:
+			/* no SIGIO for these pipes */
+			if (*val)
+				ret = EINVAL;
+			break;
+		case FIONREAD:
+			*val = pipe_nread(pipe->ctl);
+			break;
+		case FIONSPACE:
+			*val = shm_load(pipe->ctl->len) - 
+				(shm_load(pipe->ctl->prod_head) - 
+				 shm_load(pipe->ctl->tail));
+			break;
+		case MY_PIPE_SETPKT:
+			ret = pipe_setpkt(pipe, *val);
+			break;
+		case MY_PIPE_GETPKT:
+			*val = (shm_load(pipe->ctl->flags) & 
+					MY_PIPE_F_PACKET) != 0;
+			break;
+		case MY_PIPE_READV:
+			ret = pipe_readv(fp, data);
+			break;
+		case MY_PIPE_BALLOC:
+			b = data;
+			if (b->len == 0) {
+				ret = EINVAL;
+				break;
+			}
+			b->off = my_shm_balloc(b->len);
+			if (b->off == 0) {
+				ret = ENOMEM;
+				break;
+			}
+			b->addr = sharme.data_b + b->off;
+			break;
+		case MY_PIPE_BSEND:
+			ret = pipe_bsend(fp, data);
+			break;
+		case MY_PIPE_BRECV:
+			ret = pipe_brecv(fp, data);
+			break;
+		case MY_PIPE_BFREE:
+			b = data;
+			if ((ret = pipe_bvalid(b)) == 0)
+				ret = my_shm_bfree(b->off);
+			break;
+		case MY_PIPE_WAKE:
+			if (op->oper == 0)
+				pipe_wakeup(pipe->ctl->wr_waiters);
+			else
+				pipe_wakeup(pipe->ctl->rd_waiters);
+			break;
+		default: 
+			ret = ENOTTY;
+	}
+	return ret;
+}
+
+/*
+ * Are there need bytes in the pipe or did all the writers leave?
+ */
+static int pipe_can_read(struct my_pipe *pipe, uint32_t need)
+{
+	struct my_pipe_ctl *ctl = pipe->ctl;
+	return shm_load(ctl->head) - shm_load(ctl->tail) >= need ||
+		shm_load(ctl->nwriters) == 0;
+}
+
+/*
+ * Is there space for need bytes in the pipe or did all the readers leave?
+ */
+static int pipe_can_write(struct my_pipe *pipe, uint32_t need)
+{
+	struct my_pipe_ctl *ctl = pipe->ctl;
+	return shm_load(ctl->len) - (shm_load(ctl->prod_head) -
+			shm_load(ctl->tail)) >= need ||
+		shm_load(ctl->nreaders) == 0;
+}
+
+/*
+ * Wait until ready() is true. Like an adaptive mutex we first spin for about
+ * twice as long as the recent waits of this end took, bounded by the spin
+ * budget of the pipe, and then we sleep. Without doorbells, or if all the
+ * waiter slots are taken, sleeping means polling once per tick. Otherwise we
+ * publish our peer id in a waiter slot and sleep until the other side rings
+ * us. The slot is set before ready() is checked again, so a peer that moves
+ * its index after our check will see it. A signal ends the wait with EINTR
+ * or ERESTART.
+ */
+static int pipe_wait(struct my_pipe_op *op, uint32_t *waiters,
+		int (*ready)(struct my_pipe *, uint32_t), uint32_t need)
+{
+	struct my_pipe *pipe = op->pipe;
+	uint32_t *waiter;
+	int cnt, limit, max, i, error;
+	max = pipe->spin_max < 0 ? my_pipe_spin_max : pipe->spin_max;
+	limit = op->spin * 2 + MY_PIPE_SPIN_MIN;
+	if (limit > max)
+		limit = max;
+	for (cnt = 0; cnt < limit; cnt++) {
+		if (ready(pipe, need)) {
+			/* short wait, remember how long it took */
+			op->spin += (cnt - op->spin) / 8;
+			return 0;
+		}
+		pipe_pause();
+	}
+	/* spinning did not pay off, spin less the next time */
+	op->spin -= op->spin / 4;
+	waiter = NULL;
+	if (sharme.peer >= 0) {
+		for (i = 0; i < MY_PIPE_NWAITERS; i++) {
+			if (__sync_bool_compare_and_swap(&waiters[i], 0,
+						sharme.peer + 1)) {
+				waiter = &waiters[i];
+				break;
+			}
+		}
+	}
+	error = 0;
+	if (waiter == NULL) {
+		while (!ready(pipe, need)) {
+			error = kpause("mypipe", true, 1, NULL);
+			if (error == EWOULDBLOCK)
+				error = 0;
+			else if (error)
+				break;
+		}
+		return error;
+	}
+	mutex_enter(&sharme.intr_lock);
+	for (;;) {
+		membar_sync();
+		if (ready(pipe, need))
+			break;
+		/* the timeout only guards against a peer that died */
+		error = cv_timedwait_sig(&sharme.intr_cv, &sharme.intr_lock, 
+				hz);
+		if (error == EWOULDBLOCK)
+			error = 0;
+		else if (error)
+			break;
+	}
+	shm_store(*waiter, 0);
+	mutex_exit(&sharme.intr_lock);
+	return error;
+}
+
+/*
+ * Wake up the peers that sleep in the waiter slots, if any
+ */
+static void pipe_wakeup(uint32_t *waiters)
+{
+	uint32_t peer[MY_PIPE_NWAITERS];
+	int i, j;
+	if (sharme.peer < 0)
+		return;
+	/* our index update must be visible before we look for waiters */
+	membar_sync();
+	for (i = 0; i < MY_PIPE_NWAITERS; i++) {
+		peer[i] = shm_load(waiters[i]);
+		if (peer[i] == 0)
+			continue;
+		/* ring every peer once */
+		for (j = 0; j < i; j++)
+			if (peer[j] == peer[i])
+				break;
+		if (j < i)
+			continue;
+		if (peer[i] - 1 == sharme.peer) {
+			kpreempt_disable();
+			my_pipe_intr();
+			kpreempt_enable();
+		} else {
+			bus_space_write_4(sharme.reg_t, sharme.reg_h, 
+					IVSHMEM_DOORBELL, (peer[i] - 1) << 16);
+		}
+	}
+}
+
+/*
+ * Get the pipe for ourselves: keep new writers out, wait for the active ones
+ * to publish and take the read lock
+ */
+static void pipe_quiesce(struct my_pipe_ctl *ctl)
+{
+	pipe_lock(&ctl->wr_lock);
+	while (__atomic_load_n(&ctl->wr_active, __ATOMIC_SEQ_CST) != 0)
+		pipe_pause();
+	pipe_lock(&ctl->rd_lock);
+}
+
+static void pipe_unquiesce(struct my_pipe_ctl *ctl)
+{
+	pipe_unlock(&ctl->rd_lock);
+	pipe_unlock(&ctl->wr_lock);
+}
+
+/*
+ * Move the contents of the pipe to a new buffer of at least size bytes.
+ * The bytes keep their indices, so readers and writers only have to pick up
+ * the new len and buf the next time they take their lock.
+ */
+static int pipe_resize(struct my_pipe *pipe, int *size)
+{
+	struct my_pipe_ctl *ctl = pipe->ctl;
+	bus_size_t nbuf, obuf;
+	uint32_t nlen, olen, head, tail, idx, cnt;
+	if (*size <= 0 || (bus_size_t)*size > sharme.data_s)
+		return EINVAL;
+	for (nlen = MY_PIPE_BUF_SIZE; nlen < (uint32_t)*size; nlen <<= 1)
+		/* do nothing */;
+	nbuf = my_shm_alloc(nlen);
+	if (nbuf == 0)
+		return ENOMEM;
+	pipe_quiesce(ctl);
+	olen = ctl->len;
+	obuf = ctl->buf;
+	head = ctl->head;
+	tail = ctl->tail;
+	/* the bytes in the pipe do not fit in the new buffer */
+	if (head - tail > nlen) {
+		pipe_unquiesce(ctl);
+		my_shm_free(nbuf, nlen);
+		return EBUSY;
+	}
+	/* copy the bytes in chunks that do not wrap in either buffer */
+	for (idx = tail; idx != head; idx += cnt) {
+		cnt = head - idx;
+		if (cnt > olen - (idx & (olen - 1)))
+			cnt = olen - (idx & (olen - 1));
+		if (cnt > nlen - (idx & (nlen - 1)))
+			cnt = nlen - (idx & (nlen - 1));
+		memcpy(sharme.data_b + nbuf + (idx & (nlen - 1)),
+				sharme.data_b + obuf + (idx & (olen - 1)), cnt);
+	}
+	shm_store(ctl->buf, nbuf);
+	shm_store(ctl->len, nlen);
+	pipe_unquiesce(ctl);
+	my_shm_free(obuf, olen);
+	/* a bigger buffer may have made room for a sleeping writer */
+	pipe_wakeup(ctl->wr_waiters);
+	*size = nlen;
+	return 0;
+}
+
+/*
+ * Handle poll for my_pipe
+ */
+int my_pipe_poll(file_t *fp, int events)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe *pipe = op->pipe; 
+	struct my_pipe_ctl *ctl = pipe->ctl;
+	int revents = 0;
+	mutex_enter(&my_pipes_lock);
+	/* the other side must see our waiter slot before we look at the
+	 * pipe, or it may move its index without ringing us */
+	pipe_selclaim(pipe, op->oper);
+	pipe->sel_ticks[op->oper] = hardclock_ticks;
+	membar_sync();
+	if (op->oper == 0) {
+		if (shm_load(ctl->head) != shm_load(ctl->tail))
+			revents |= events & (POLLIN | POLLRDNORM);
+		if (shm_load(ctl->nwriters) == 0)
+			revents |= POLLHUP;
+	} else {
+		if (pipe_can_write(pipe, PIPE_BUF))
+			revents |= events & (POLLOUT | POLLWRNORM);
+		if (shm_load(ctl->nreaders) == 0)
+			revents |= POLLHUP;
+	}
+	if (revents == 0)
+		selrecord(curlwp, &pipe->sel[op->oper]);
+	mutex_exit(&my_pipes_lock);
+	return revents;
+}
+
+/*
+ * Handle kqueue for my_pipe, the read end only takes EVFILT_READ and the
+ * write end only EVFILT_WRITE
+ */
+int my_pipe_kqfilter(file_t *fp, struct knote *kn)
+{
+	struct my_pipe_op *op = fp->f_data; 
+	struct my_pipe *pipe = op->pipe; 
+	switch (kn->kn_filter) {
+		case EVFILT_READ:
+			if (op->oper != 0)
+				return EINVAL;
+			kn->kn_fop = &my_pipe_rfiltops;
+			break;
+		case EVFILT_WRITE:
+			if (op->oper != 1)
+				return EINVAL;
+			kn->kn_fop = &my_pipe_wfiltops;
+			break;
+		default: 
+			return EINVAL;
+	}
+	kn->kn_hook = op;
+	mutex_enter(&my_pipes_lock);
+	pipe_selclaim(pipe, op->oper);
+	SLIST_INSERT_HEAD(&pipe->sel[op->oper].sel_klist, kn, kn_selnext);
+	mutex_exit(&my_pipes_lock);
+	return 0;
+}
+
+static void filt_my_pipedetach(struct knote *kn)
+{
+	struct my_pipe_op *op = kn->kn_hook;
+	struct my_pipe *pipe = op->pipe;
+	mutex_enter(&my_pipes_lock);
+	SLIST_REMOVE(&pipe->sel[op->oper].sel_klist, kn, knote, kn_selnext);
+	if (!pipe_selbusy(pipe, op->oper))
+		pipe_selrelease(pipe, op->oper);
+	mutex_exit(&my_pipes_lock);
+}
+
+static int filt_my_piperead(struct knote *kn, long hint)
+{
+	struct my_pipe_op *op = kn->kn_hook;
+	struct my_pipe_ctl *ctl = op->pipe->ctl;
+	kn->kn_data = shm_load(ctl->head) - shm_load(ctl->tail);
+	if (shm_load(ctl->nwriters) == 0) {
+		kn->kn_flags |= EV_EOF;
+		return 1;
+	}
+	return kn->kn_data > 0;
+}
+
+static int filt_my_pipewrite(struct knote *kn, long hint)
+{
+	struct my_pipe_op *op = kn->kn_hook;
+	struct my_pipe_ctl *ctl = op->pipe->ctl;
+	if (shm_load(ctl->nreaders) == 0) {
+		kn->kn_data = 0;
+		kn->kn_flags |= EV_EOF;
+		return 1;
+	}
+	kn->kn_data = shm_load(ctl->len) - (shm_load(ctl->prod_head) - 
+			shm_load(ctl->tail));
+	return kn->kn_data >= PIPE_BUF;
+}
+
+/*
+ * Keep a waiter slot on the side of the pipe while it has pollers, so that
+ * the other side rings us every time it moves its index. Without doorbells,
+ * or if there is no free slot, the pollers are woken every tick instead.
+ * The claim goes when the last knote detaches, or on a tick once nobody has
+ * polled for MY_PIPE_SEL_IDLE and no poll(2) sleeps on it.
+ * Called with my_pipes_lock held.
+ */
+static void pipe_selclaim(struct my_pipe *pipe, int side)
+{
+	uint32_t *waiters;
+	int i;
+	if (pipe->sel_waiter[side] != NULL || pipe->sel_poll[side])
+		return;
+	if (my_pipe_sel_claims++ == 0)
+		callout_schedule(&my_pipe_ch, MY_PIPE_SEL_IDLE);
+	waiters = side == 0 ? pipe->ctl->rd_waiters : pipe->ctl->wr_waiters;
+	if (sharme.peer >= 0) {
+		for (i = 0; i < MY_PIPE_NWAITERS; i++) {
+			if (__sync_bool_compare_and_swap(&waiters[i], 0,
+						sharme.peer + 1)) {
+				pipe->sel_waiter[side] = &waiters[i];
+				return;
+			}
+		}
+	}
+	pipe->sel_poll[side] = 1;
+	if (my_pipe_sel_polling++ == 0)
+		callout_schedule(&my_pipe_ch, 1);
+}
+
+/*
+ * Give back what pipe_selclaim() took. Called with my_pipes_lock held.
+ */
+static void pipe_selrelease(struct my_pipe *pipe, int side)
+{
+	if (pipe->sel_waiter[side] == NULL && !pipe->sel_poll[side])
+		return;
+	if (pipe->sel_waiter[side] != NULL) {
+		shm_store(*pipe->sel_waiter[side], 0);
+		pipe->sel_waiter[side] = NULL;
+	}
+	if (pipe->sel_poll[side]) {
+		pipe->sel_poll[side] = 0;
+		my_pipe_sel_polling--;
+	}
+	my_pipe_sel_claims--;
+}
+
+/*
+ * Does the side still have pollers: a knote, or a poll(2) that recorded
+ * itself and did not return yet? selrecord() runs under my_pipes_lock, so
+ * one that is not there now is not about to be.
+ * Called with my_pipes_lock held.
+ */
+static int pipe_selbusy(struct my_pipe *pipe, int side)
+{
+	struct selinfo *sip = &pipe->sel[side];
+	return !SLIST_EMPTY(&sip->sel_klist) || sip->sel_lwp != NULL || 
+		sip->sel_collision != 0;
+}
+
+/*
+ * Let the pollers of every pipe check their pipe again
+ */
+static void pipe_selwakeup(void *arg)
+{
+	struct my_pipe *pipe;
+	mutex_enter(&my_pipes_lock);
+	LIST_FOREACH(pipe, &my_pipes, list) {
+		selnotify(&pipe->sel[0], 0, 0);
+		selnotify(&pipe->sel[1], 0, 0);
+	}
+	mutex_exit(&my_pipes_lock);
+}
+
+/*
+ * Wake up the pollers without a waiter slot and drop the claims nobody
+ * polls on any more
+ */
+static void pipe_seltick(void *arg)
+{
+	struct my_pipe *pipe;
+	int side;
+	if (my_pipe_sel_polling > 0)
+		pipe_selwakeup(NULL);
+	mutex_enter(&my_pipes_lock);
+	LIST_FOREACH(pipe, &my_pipes, list) {
+		for (side = 0; side < 2; side++) {
+			if (hardclock_ticks - pipe->sel_ticks[side] >= 
+					MY_PIPE_SEL_IDLE && 
+					!pipe_selbusy(pipe, side))
+				pipe_selrelease(pipe, side);
+		}
+	}
+	if (my_pipe_sel_polling > 0)
+		callout_schedule(&my_pipe_ch, 1);
+	else if (my_pipe_sel_claims > 0)
+		callout_schedule(&my_pipe_ch, MY_PIPE_SEL_IDLE);
+	mutex_exit(&my_pipes_lock);
+}
+
+/*
+ * Set up the bookkeeping of the pipes of this kernel, ivshmem calls it when
+ * it attaches
+ */
+void my_pipe_init(void)
+{
+	mutex_init(&my_pipes_lock, MUTEX_DEFAULT, IPL_NONE);
+	my_pipe_si = softint_establish(SOFTINT_CLOCK | SOFTINT_MPSAFE, 
+			pipe_selwakeup, NULL);
+	callout_init(&my_pipe_ch, CALLOUT_MPSAFE);
+	callout_setfunc(&my_pipe_ch, pipe_seltick, NULL);
+}
+
+/*
+ * Something may have changed in the pipes, wake up whoever sleeps or polls.
+ * Called from the doorbell interrupt or with preemption disabled.
+ */
+void my_pipe_intr(void)
+{
+	mutex_enter(&sharme.intr_lock);
+	cv_broadcast(&sharme.intr_cv);
+	mutex_exit(&sharme.intr_lock);
+	if (my_pipe_si != NULL)
+		softint_schedule(my_pipe_si);
+}
+
+/*
+ * We are the child of a fork. The waiter slots we kept for pollers hold the
+ * peer id of the parent, which keeps them, so take new ones with our id.
+ */
+void my_pipe_forked(void)
+{
+	struct my_pipe *pipe;
+	int side;
+	mutex_enter(&my_pipes_lock);
+	LIST_FOREACH(pipe, &my_pipes, list) {
+		for (side = 0; side < 2; side++) {
+			if (pipe->sel_waiter[side] == NULL)
+				continue;
+			pipe->sel_waiter[side] = NULL;
+			my_pipe_sel_claims--;
+			pipe_selclaim(pipe, side);
+		}
+	}
+	mutex_exit(&my_pipes_lock);
+}
+
+/*
+ * Create a pipe, flags are O_CLOEXEC, O_NONBLOCK, O_NOSIGPIPE and O_DIRECT
+ * for packet mode
+ */
+static int my_pipe1(struct lwp *l, int *fildes, int flags, register_t *retval)
 {
 	file_t *rf, *wf;
 	int fd[2], error, descr;
 	struct my_pipe *pipe = NULL;
 	struct my_pipe_op *ro = NULL, *wo = NULL;
-	uint8_t init; 
-	uint8_t smalls[5], nparts[2];
-	uint32_t bigs[4];
+	struct my_pipe_ctl *ctl;
+	bus_size_t ctl_off, buf, size;
 
-	/* allocate my_pipe_op and my_pipe structs and initialize them */
+	if (flags & ~(O_CLOEXEC | O_NONBLOCK | O_NOSIGPIPE | O_DIRECT))
+		return EINVAL;
+	/* set up shared memory the first time someone uses it */
+	if ((error = my_shm_init()) != 0)
+		return error;
+	/* allocate my_pipe_op and my_pipe structs */
 	pipe = malloc(sizeof(struct my_pipe), M_TEMP, M_WAITOK);
-	if (pipe == NULL)
-		return ENOMEM;
 	ro = malloc(sizeof(struct my_pipe_op), M_TEMP, M_WAITOK);
-	if (pipe == NULL)
-		goto malloc_fail;
 	wo = malloc(sizeof(struct my_pipe_op), M_TEMP, M_WAITOK);
-	if (pipe == NULL)
+	if (pipe == NULL || ro == NULL || wo == NULL) {
+		error = ENOMEM;
+		goto malloc_fail;
+	}
+	/* allocate the control block and the buffer of the pipe in shared
+	 * memory */
+	ctl_off = my_shm_alloc(MY_PIPE_CTL_SIZE);
+	if (ctl_off == 0) {
+		error = ENOMEM;
 		goto malloc_fail;
-	pipe->init = 0;
-	pipe->lock = pipe->init + 1;
-	pipe->wr_lock = pipe->lock + 1;
-	pipe->nreaders = pipe->wr_lock + 1;
-	pipe->nwriters = pipe->nreaders + 1;
-	pipe->len = pipe->nwriters + 1;
-	pipe->in = pipe->len + 4;
-	pipe->out = pipe->in + 4;
-	pipe->cnt = pipe->out + 4;
-	pipe->buf = pipe->cnt + 4;
+	}
+	size = sharme.pipe_size ? sharme.pipe_size : MY_PIPE_BUF_SIZE;
+	buf = my_shm_alloc(size);
+	if (buf == 0) {
+		error = ENOMEM;
+		goto shm_fail;
+	}
+	ctl = (struct my_pipe_ctl *)(sharme.data_b + ctl_off);
+	pipe->ctl = ctl;
+	pipe->ctl_off = ctl_off;
 	pipe->pr_readers = 1;
 	pipe->pr_writers = 1;
-	/* check if shared memory is initialized and if not then initialize it */
-	init = bus_space_read_1(sharme.data_t, sharme.data_h, pipe->init); 
-	if (init == 0) {
-		smalls[0] = 1;
-		smalls[1] = 0;
-		smalls[2] = 0;
-		smalls[3] = 0;
-		smalls[4] = 0;
-		write_region_1(pipe->init, smalls, 5);
-		bigs[0] = MY_PIPE_BUF_SIZE;
-		bigs[1] = 0;
-		bigs[2] = 0;
-		bigs[3] = 0;
-		write_region_4(pipe->len, bigs, 4);
-	}
-	/* increase reaaders and writters in pipe */
-	pipe_lock(pipe->lock);
-	read_region_1(pipe->nreaders, nparts, 2);
-	nparts[0]++;
-	nparts[1]++;
-	write_region_1(pipe->nreaders, nparts, 2);
-	pipe_unlock(pipe->lock);
+	pipe->spin_max = -1;
+	selinit(&pipe->sel[0]);
+	selinit(&pipe->sel[1]);
+	pipe->sel_waiter[0] = pipe->sel_waiter[1] = NULL;
+	pipe->sel_poll[0] = pipe->sel_poll[1] = 0;
+	pipe->sel_ticks[0] = pipe->sel_ticks[1] = 0;
+	/* initialize the control block, with one reader and one writer */
+	memset(ctl, 0, MY_PIPE_CTL_SIZE);
+	ctl->nreaders = 1;
+	ctl->nwriters = 1;
+	ctl->len = size;
+	ctl->buf = buf;
+	if (flags & O_DIRECT)
+		ctl->flags = MY_PIPE_F_PACKET;
+	membar_producer();
+	/* and make it visible in the directory */
+	pipe->slot = my_shm_slot_get(ctl_off);
+	if (pipe->slot < 0) {
+		error = ENFILE;
+		goto slot_fail;
+	}
 	sharme.pipeops = &my_pipeops;
+	mutex_enter(&my_pipes_lock);
+	LIST_INSERT_HEAD(&my_pipes, pipe, list);
+	mutex_exit(&my_pipes_lock);
 	ro->oper = 0;
 	wo->oper = 1;
+	ro->spin = wo->spin = 0;
 	ro->pipe = wo->pipe = pipe;
 	/* allocate read end of pipe */
 	error = fd_allocfile(&rf, &descr);
 	if (error)
-		return error;
+		goto fd_fail;
 	fd[0] = descr;
 	/* allocate write end of pipe */
 	error = fd_allocfile(&wf, &descr);
@@ -296,105 +1253,104 @@ int sys_my_pipe(struct lwp *l, const struct sys_my_pipe_args *uap,
 		goto my_pipe_error;
 	fd[1] = descr;
 	/* initialization of read file_t */
-	rf->f_flag = FREAD;
+	rf->f_flag = FREAD | (flags & (O_NONBLOCK | O_NOSIGPIPE));
 	rf->f_type = DTYPE_MISC;
 	rf->f_ops = &my_pipeops;
 	rf->f_data = ro;
-	fd_set_exclose(l, (int)fd[0], (O_CLOEXEC) != 0);
+	fd_set_exclose(l, (int)fd[0], (flags & O_CLOEXEC) != 0);
 	/* initialization of write file_t */
-	wf->f_flag = FWRITE;
+	wf->f_flag = FWRITE | (flags & (O_NONBLOCK | O_NOSIGPIPE));
 	wf->f_type = DTYPE_MISC;
 	wf->f_ops = &my_pipeops;
 	wf->f_data = wo;
-	fd_set_exclose(l, (int)fd[1], (O_CLOEXEC) != 0);
+	fd_set_exclose(l, (int)fd[1], (flags & O_CLOEXEC) != 0);
 
 	/* add those files to the process that made the system call */
 	fd_affix(curproc, rf, (int)fd[0]);
 	fd_affix(curproc, wf, (int)fd[1]);
 	/* return the file descriptors */
-	if ((error = copyout(fd, SCARG(uap, fildes), sizeof(fd))) != 0)
+	if ((error = copyout(fd, fildes, sizeof(fd))) != 0)
 		return error;
 
 	*retval = 0;
 	return 0;
 my_pipe_error:
 	fd_abort(curproc, rf, (int)fd[0]);
-	return error;
+fd_fail:
+	mutex_enter(&my_pipes_lock);
+	LIST_REMOVE(pipe, list);
+	mutex_exit(&my_pipes_lock);
+	my_shm_slot_put(pipe->slot);
+slot_fail:
+	seldestroy(&pipe->sel[0]);
+	seldestroy(&pipe->sel[1]);
+	my_shm_free(buf, size);
+shm_fail:
+	my_shm_free(ctl_off, MY_PIPE_CTL_SIZE);
 malloc_fail:
-	free(pipe, M_TEMP);
-	free(ro, M_TEMP);
-	free(wo, M_TEMP);
-	return ENOMEM;
+	if (pipe != NULL)
+		free(pipe, M_TEMP);
+	if (ro != NULL)
+		free(ro, M_TEMP);
+	if (wo != NULL)
+		free(wo, M_TEMP);
+	return error;
 }
 
 /*
- * Spinlock for pipe 
+ * Handle the system call
  */
-void pipe_lock(bus_size_t lock)
+int sys_my_pipe(struct lwp *l, const struct sys_my_pipe_args *uap, 
+		register_t *retval)
 {
-	while(__sync_val_compare_and_swap((uint8_t *)sharme.data_b + lock, 0, 1) == 1)
-		/* do nothing */; 
-	return;
+	return my_pipe1(l, SCARG(uap, fildes), O_CLOEXEC, retval);
 }
 
 /*
- * Release the lock
+ * Like my_pipe, with flags
  */
-void pipe_unlock(bus_size_t lock) 
+int sys_my_pipe2(struct lwp *l, const struct sys_my_pipe2_args *uap, 
+		register_t *retval)
 {
-	__sync_lock_release((uint8_t *)sharme.data_b + lock);
-	return;
+	return my_pipe1(l, SCARG(uap, fildes), SCARG(uap, flags), retval);
 }
 
 /*
- * Read a region of bytes in bus (data is 1 byte)
+ * Spinlock for pipe 
  */
-void read_region_1(bus_size_t offset, uint8_t *datap, bus_size_t count)
+void pipe_lock(uint8_t *lock)
 {
-	int i;
-	for (i=0; i<count; i++) {
-		datap[i] = bus_space_read_1(sharme.data_t, sharme.data_h, 
-				offset + i);
-	}
+	while(__sync_val_compare_and_swap(lock, 0, 1) == 1)
+		pipe_pause();
 	return;
 }
 
 /*
- * Read a region of bytes in bus (data is 4 byte)
+ * Release the lock
  */
-void read_region_4(bus_size_t offset, uint32_t *datap, bus_size_t count)
+void pipe_unlock(uint8_t *lock)
 {
-	int i;
-	for (i=0; i<count; i++) {
-		datap[i] = bus_space_read_4(sharme.data_t, sharme.data_h, 
-				offset + i*4);
-	}
+	__sync_lock_release(lock);
 	return;
 }
 
 /*
- * Write in a region of bytes in bus (data is 1 byte)
+ * kern.my_pipe.spin_max, the spin budget of pipes that did not set their own
  */
-void write_region_1(bus_size_t offset, uint8_t *datap, bus_size_t count)
+SYSCTL_SETUP(sysctl_kern_my_pipe_setup, "sysctl kern.my_pipe subtree setup")
 {
-	int i;
-	for (i=0; i<count; i++) {
-		bus_space_write_1(sharme.data_t, sharme.data_h, offset + i, 
-				datap[i]);
-	}
-	return;
-}
+	const struct sysctlnode *node = NULL;
 
-/*
- * Write in a region of bytes in bus (data is 4 byte)
- */
-void write_region_4(bus_size_t offset, uint32_t *datap, bus_size_t count)
-{
-	int i;
-	for (i=0; i<count; i++) {
-		bus_space_write_4(sharme.data_t, sharme.data_h,	offset + i*4, 
-				datap[i]);
-	}
-	return;
+	sysctl_createv(clog, 0, NULL, &node,
+			CTLFLAG_PERMANENT,
+			CTLTYPE_NODE, "my_pipe",
+			SYSCTL_DESCR("ivshmem pipe settings"),
+			NULL, 0, NULL, 0,
+			CTL_KERN, CTL_CREATE, CTL_EOL);
+	sysctl_createv(clog, 0, &node, NULL,
+			CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			CTLTYPE_INT, "spin_max",
+			SYSCTL_DESCR("Iterations a pipe spins before it sleeps"),
+			NULL, 0, &my_pipe_spin_max, 0,
+			CTL_CREATE, CTL_EOL);
 }
-
@@ -0,0 +1,124 @@
+#!/bin/bash
+#
+# Fork latency against the memory of the guest. For every memory size the
+# unikernel of test.c forks -n times, qemu logs its stages in MY_FORK_LOG and
+# the two are joined by the fork id. Prints p50/p99 of every stage in ms.
+#
+
+BIN=test-rumprun.bin
+SHM_SIZE=1M
+OUT_DIR=/tmp/fork_bench
+
+forks=20
+pipe=""
+mems="64 128 256 512 1024"
+print_usage () {
+	echo "Usage: ./fork_bench.sh [-n forks] [-p] [-b bin] [mem_MB ...]"
+	echo -e "\t-n:\t forks for every memory size (default ${forks})"
+	echo -e "\t-p:\t keep a pipe open, so the handshake is measured too"
+	echo -e "\t-b:\t unikernel to run (default ${BIN})"
+	echo -e "\t-h:\t print this help"
+}
+
+while getopts ":n:pb:h" opt; do
+	case $opt in
+		n)
+			forks=$OPTARG
+			;;
+		p)
+			pipe="-p"
+			;;
+		b)
+			BIN=$OPTARG
+			;;
+		h)
+			print_usage
+			exit
+			;;
+		\?)
+			echo "Invalid option: -$OPTARG" 
+			echo "Use option -h for help" 
+			exit
+			;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -gt 0 ]
+then
+	mems="$@"
+fi
+
+## stage and duration in ns, one per line
+durations () {
+	awk '
+	FILENAME == ARGV[1] && $1 == "G" {
+		print "1.hypercall", $3
+		if ($4 > 0)
+			print "6.handshake", $4
+		print "7.total", $5
+		next
+	}
+	FILENAME == ARGV[2] {
+		t[$1 " " $2] = $3
+		ids[$1] = 1
+	}
+	END {
+		for (id in ids) {
+			if ((id " start") in t && (id " migrated") in t)
+				print "2.migrate.host", t[id " migrated"] - t[id " start"]
+			if ((id " fork") in t && (id " exec") in t)
+				print "4.execve.host", t[id " exec"] - t[id " fork"]
+			if ((id " exec") in t && (id " loaded") in t)
+				print "5.load.host", t[id " loaded"] - t[id " exec"]
+			if ((id " exec") in t && (id " paged") in t)
+				print "5.paged.host", t[id " paged"] - t[id " exec"]
+			if ((id " start") in t && (id " loaded") in t)
+				print "7.child.host", t[id " loaded"] - t[id " start"]
+		}
+	}' "$1" "$2"
+}
+
+## p50/p99 of every stage, the input is sorted by stage and duration
+percentiles () {
+	awk -v mem=$1 '
+	function flush() {
+		if (n == 0)
+			return
+		printf "%6s %-16s %6d %10.3f %10.3f\n", mem, stage, n,
+		       v[int((n - 1) * 0.50) + 1] / 1e6,
+		       v[int((n - 1) * 0.99) + 1] / 1e6
+		n = 0
+	}
+	$1 != stage {
+		flush()
+		stage = $1
+	}
+	{
+		v[++n] = $2
+	}
+	END {
+		flush()
+	}'
+}
+
+mkdir -p ${OUT_DIR}
+rev=$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null)
+echo "# rev ${rev:-unknown}, ${forks} forks per size"
+printf "%6s %-16s %6s %10s %10s\n" "mem" "stage" "n" "p50(ms)" "p99(ms)"
+for mem in $mems
+do
+	log=${OUT_DIR}/qemu.${mem}.log
+	out=${OUT_DIR}/guest.${mem}.out
+	rm -f $log
+	MY_FORK_LOG=$log rumprun kvm -M $mem -g "-vga none -nographic -device ivshmem-plain,memdev=hostmem -object memory-backend-file,size=${SHM_SIZE},share,mem-path=/dev/shm/ivshmem,id=hostmem" -i $BIN -n $forks $pipe | tr -d '\r' > $out
+	## the children may still be loading, give them 30s
+	for i in $(seq 30)
+	do
+		if [ $(grep -c " loaded " $log 2>/dev/null) -ge $forks ]
+		then
+			break
+		fi
+		sleep 1
+	done
+	durations $out $log | sort -k1,1 -k2,2n | percentiles $mem
+done
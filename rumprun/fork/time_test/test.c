@@ -1,15 +1,34 @@
+/*
+ * How long my_fork takes. Without arguments it forks once and prints the time
+ * in both unikernels. With -n it forks that many times, the child exits right
+ * away, and for every fork the parent prints the stages of kern.my_fork.times
+ *
+ *	G id hypercall handshake total		(ns)
+ *
+ * fork_bench.sh joins these lines with the timestamps of qemu.
+ *
+ *	test [-n forks] [-p]
+ *	-p	keep a pipe open, so the fork waits for the child in the shared
+ *		memory too
+ */
 #include <sys/stat.h>
+#include <sys/sysctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <sys/time.h> 
+#include "../my_pipe.h"
 #define USEC            1000000
 
-int main()
+int my_pipe(int fildes[2]);
+int my_fork(void);
+
+//fork once and print how long it took
+static int fork_once(void)
 {
-	int fd[2], n;
+	int n;
 	struct timeval t1, t2;
 	gettimeofday(&t1, 0);
 	//n = fork();
@@ -28,4 +47,48 @@ int main()
 	return 0;
 }
 
-
+int main(int argc, char **argv)
+{
+	struct my_fork_times ft;
+	size_t len;
+	int opt, forks = 0, use_pipe = 0, fd[2], i, n;
+	while ((opt = getopt(argc, argv, "n:p")) != -1) {
+		switch (opt) {
+			case 'n':
+				forks = atoi(optarg);
+				break;
+			case 'p':
+				use_pipe = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: test [-n forks] [-p]\n");
+				exit(1);
+		}
+	}
+	if (forks <= 0)
+		return fork_once();
+	if (use_pipe && my_pipe(fd) < 0) {
+		perror("my_pipe");
+		exit(1);
+	}
+	for (i = 0; i < forks; i++) {
+		n = my_fork();
+		if (n < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (n == 0)
+			/* child, halt the unikernel */
+			return 0;
+		len = sizeof(ft);
+		if (sysctlbyname("kern.my_fork.times", &ft, &len, NULL, 0) < 0) {
+			perror("kern.my_fork.times");
+			exit(1);
+		}
+		printf("G %u %lld %lld %lld\n", ft.id,
+				(long long)ft.hypercall, (long long)ft.handshake,
+				(long long)ft.total);
+	}
+	fflush(stdout);
+	return 0;
+}
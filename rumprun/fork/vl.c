@@ -30,6 +30,10 @@
 /* argv is needed for execve in my_fork*/
 char **my_argv;
 int my_argc;
+/* fork timing of the child qemu and -fork-opts, in kvm-all.c */
+void my_fork_exec_stamp(void);
+void my_fork_set_opts(const char *str);
+void my_fork_init(void);
 #ifdef CONFIG_SECCOMP
 #include "sysemu/seccomp.h"
 #include "sys/prctl.h"
@@ -3091,10 +3095,33 @@ static void register_global_properties(MachineState *ms)
     user_register_global_props();
 }
 
+/*
+ * -fork-opts is not a real qemu option, take it out of argv before qemu
+ * parses the command line and return the new argc
+ */
+static int fork_opts_prescan(int argc, char **argv)
+{
+	int i, n = 1;
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-fork-opts") == 0 || 
+				strcmp(argv[i], "--fork-opts") == 0) && 
+				i + 1 < argc) {
+			my_fork_set_opts(argv[++i]);
+			continue;
+		}
+		argv[n++] = argv[i];
+	}
+	argv[n] = NULL;
+	return n;
+}
+
 int main(int argc, char **argv, char **envp)
 {
+	/* children get the whole command line, -fork-opts too */
 	my_argc = argc;
-	my_argv = argv;
+	my_argv = g_memdup(argv, (argc + 1) * sizeof(*argv));
+	argc = fork_opts_prescan(argc, argv);
+	my_fork_exec_stamp();
     int i;
     int snapshot, linux_boot;
     const char *initrd_filename;
@@ -4900,6 +4927,8 @@ int main(int argc, char **argv, char **envp)
         return 0;
     }
 
+    my_fork_init();
+
     if (incoming) {
         Error *local_err = NULL;
         qemu_start_incoming_migration(incoming, &local_err);